@@ -0,0 +1,267 @@
+#include "batchexport.hxx"
+#include "document.hxx"
+#include "imageexport.hxx"
+#include "vectorexport.hxx"
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QSet>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct ExportJob
+{
+    Document* doc;
+    ImageExporter* exporter;
+    QString fileName;
+    QFuture<bool> result;
+};
+
+void freeDocument(Document* doc)
+{
+    DiagramScene* scene = doc->scene();
+    delete doc;
+    delete scene;
+}
+
+Document* loadDocument(const QString& fileName)
+{
+    QFile file(fileName);
+    Document* doc = Document::createDocument(NULL);
+    if (!file.open(QIODevice::ReadOnly) || !doc->load(file))
+    {
+        qWarning("failed to load %s", qPrintable(fileName));
+        freeDocument(doc);
+        return NULL;
+    }
+    return doc;
+}
+
+// the output file of a document; documents of the same name from different
+// folders get a numbered suffix instead of overwriting each other
+QString outputPath(const QString& outDir, const QString& fileName, const QString& format, QSet<QString>& used)
+{
+    QDir dir(outDir);
+    QString base = QFileInfo(fileName).completeBaseName();
+    QString path = dir.filePath(base + "." + format);
+    if (used.contains(QFileInfo(path).absoluteFilePath().toLower()))
+    {
+        int n = 2;
+        do
+            path = dir.filePath(QString("%1-%2.%3").arg(base).arg(n++).arg(format));
+        while (used.contains(QFileInfo(path).absoluteFilePath().toLower()));
+        qWarning("%s: name already used, writing %s", qPrintable(fileName), qPrintable(path));
+    }
+    used.insert(QFileInfo(path).absoluteFilePath().toLower());
+    return path;
+}
+
+bool writeExport(ImageExporter* exporter, QString fileName, QByteArray format)
+{
+    if (format == "png")
+        return exporter->writePng(fileName);
+    return exporter->render().save(fileName, format.constData());
+}
+
+// waits for the job and frees its document; false if the export failed
+bool finishJob(ExportJob& job)
+{
+    bool ok = job.result.result();
+    if (!ok)
+        qWarning("failed to write %s", qPrintable(job.fileName));
+    delete job.exporter;
+    freeDocument(job.doc);
+    return ok;
+}
+
+bool BatchExport::isRequested(int argc, char** argv)
+{
+    for (int i=1; i<argc; i++)
+    {
+        if (qstrcmp(argv[i], "--export") == 0 || qstrncmp(argv[i], "--export=", 9) == 0)
+            return true;
+    }
+    return false;
+}
+
+// shells on windows leave *.bmml to the program
+QStringList BatchExport::expandWildcards(const QStringList& args)
+{
+    QStringList files;
+    foreach (const QString& arg, args)
+    {
+        if (!arg.contains('*') && !arg.contains('?'))
+        {
+            files.append(arg);
+            continue;
+        }
+        QFileInfo info(arg);
+        QDir dir = info.dir();
+        foreach (const QString& name, dir.entryList(QStringList(info.fileName()), QDir::Files, QDir::Name))
+            files.append(dir.filePath(name));
+    }
+    return files;
+}
+
+int BatchExport::run(const QStringList& arguments)
+{
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption exportOption("export", "Render the files into <dir> and exit.", "dir");
+    QCommandLineOption formatOption("format", "Output format (an image format, pdf or svg), png by default.", "format", "png");
+    QCommandLineOption jobsOption("jobs", "Number of documents rendered at once.", "n",
+        QString::number(QThread::idealThreadCount()));
+    QCommandLineOption scaleOption("scale", "Output pixels per document pixel.", "factor", "1");
+    parser.addOption(exportOption);
+    parser.addOption(formatOption);
+    parser.addOption(jobsOption);
+    parser.addOption(scaleOption);
+    parser.addPositionalArgument("files", "Documents to render; wildcards are expanded.", "files...");
+    parser.process(arguments);
+
+    QString outDir = parser.value(exportOption);
+    QByteArray format = parser.value(formatOption).toLower().toLatin1();
+    // an --export path ending in .pdf asks for the one-file pdf
+    if (outDir.endsWith(".pdf", Qt::CaseInsensitive))
+    {
+        if (!parser.isSet(formatOption))
+            format = "pdf";
+        else if (format != "pdf")
+        {
+            qWarning("%s is a pdf file, but the format is %s", qPrintable(outDir), format.constData());
+            return 2;
+        }
+    }
+    bool jobsOk;
+    int jobs = parser.value(jobsOption).toInt(&jobsOk);
+    qreal scale = parser.value(scaleOption).toDouble();
+    QStringList files = expandWildcards(parser.positionalArguments());
+    if (!jobsOk || jobs < 1)
+    {
+        qWarning("invalid job count %s", qPrintable(parser.value(jobsOption)));
+        return 2;
+    }
+    if (scale <= 0)
+    {
+        qWarning("invalid scale %s", qPrintable(parser.value(scaleOption)));
+        return 2;
+    }
+    if (format != "png" && !VectorExporter::isVectorFormat(format) &&
+        !QImageWriter::supportedImageFormats().contains(format))
+    {
+        qWarning("unsupported format %s", format.constData());
+        return 2;
+    }
+    if (VectorExporter::isVectorFormat(format))
+    {
+        if (parser.isSet(jobsOption) || parser.isSet(scaleOption))
+            qWarning("--jobs and --scale are ignored for %s", format.constData());
+        return exportVector(files, outDir, format);
+    }
+    return exportImages(files, outDir, format, jobs, scale);
+}
+
+int BatchExport::exportImages(const QStringList& files, const QString& outDir, const QByteArray& format,
+    int jobs, qreal scale)
+{
+    if (!QDir().mkpath(outDir))
+    {
+        qWarning("cannot create %s", qPrintable(outDir));
+        return 2;
+    }
+
+    // each worker renders a whole document, so the tiles of one document
+    // render on that worker rather than on the pool
+    QThreadPool pool;
+    pool.setMaxThreadCount(jobs);
+    QList<ExportJob> pending;
+    QSet<QString> used;
+    int failed = 0;
+    foreach (const QString& fileName, files)
+    {
+        if (pending.length() >= jobs)
+        {
+            if (!finishJob(pending.first()))
+                failed++;
+            pending.removeFirst();
+        }
+
+        Document* doc = loadDocument(fileName);
+        if (doc == NULL)
+        {
+            failed++;
+            continue;
+        }
+
+        ExportJob job;
+        job.doc = doc;
+        job.exporter = new ImageExporter(doc->scene(), scale);
+        job.exporter->setThreadPool(NULL);
+        job.fileName = outputPath(outDir, fileName, format, used);
+        job.result = QtConcurrent::run(&pool, writeExport, job.exporter, job.fileName, format);
+        pending.append(job);
+    }
+    while (!pending.isEmpty())
+    {
+        if (!finishJob(pending.first()))
+            failed++;
+        pending.removeFirst();
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+int BatchExport::exportVector(const QStringList& files, const QString& out, const QString& format)
+{
+    // one multi-page pdf, or a file per document
+    bool singleFile = format == "pdf" && out.endsWith(".pdf", Qt::CaseInsensitive);
+    QString dir = singleFile ? QFileInfo(out).absolutePath() : out;
+    if (!QDir().mkpath(dir))
+    {
+        qWarning("cannot create %s", qPrintable(dir));
+        return 2;
+    }
+
+    VectorExporter* book = singleFile ? new VectorExporter(out, format) : NULL;
+    QSet<QString> used;
+    int failed = 0;
+    foreach (const QString& fileName, files)
+    {
+        Document* doc = loadDocument(fileName);
+        if (doc == NULL)
+        {
+            failed++;
+            continue;
+        }
+        bool ok;
+        QString outFile = out;
+        if (book != NULL)
+            ok = book->addPage(doc->scene());
+        else
+        {
+            outFile = outputPath(out, fileName, format, used);
+            VectorExporter exporter(outFile, format);
+            ok = exporter.addPage(doc->scene()) && exporter.end();
+        }
+        if (!ok)
+        {
+            qWarning("failed to write %s", qPrintable(outFile));
+            failed++;
+        }
+        freeDocument(doc);
+    }
+    if (book != NULL)
+    {
+        if (!book->end())
+        {
+            qWarning("failed to write %s", qPrintable(out));
+            failed++;
+        }
+        delete book;
+    }
+    return failed == 0 ? 0 : 1;
+}
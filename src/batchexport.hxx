@@ -0,0 +1,33 @@
+#ifndef BATCHEXPORT_H
+#define BATCHEXPORT_H
+
+#include <QStringList>
+
+///////////////////////////////////////////////////////////////////////////////
+
+// the command line export mode:
+//     WireframeBuilder --export out/ [--format png] [--jobs N] [--scale F] files...
+// documents are loaded and snapshotted on the gui thread and rendered and
+// encoded on a pool of N workers, one document per worker; at most N are
+// in flight at once. runs under the offscreen platform.
+//
+// pdf and svg are written on the gui thread, one document at a time, so
+// --jobs and --scale do not apply to them. with an --export path ending in
+// .pdf, every document becomes a page of that one file; --format may then
+// be left out.
+class BatchExport
+{
+public:
+    static bool isRequested(int argc, char** argv);
+    static QStringList expandWildcards(const QStringList& args);
+
+    // returns the process exit code
+    int run(const QStringList& arguments);
+
+private:
+    int exportImages(const QStringList& files, const QString& outDir, const QByteArray& format,
+        int jobs, qreal scale);
+    int exportVector(const QStringList& files, const QString& out, const QString& format);
+};
+
+#endif // BATCHEXPORT_H
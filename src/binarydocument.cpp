@@ -0,0 +1,210 @@
+#include "binarydocument.hxx"
+#include "itemdata.hxx"
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QVector>
+
+#define WFB_MAGIC                           "WFB\x1a"
+#define WFB_BYTE_ORDER                      0x01020304
+
+// all fields are stored in host byte order; the byteOrder marker rejects
+// files written on a machine of the other endianness.
+struct WfbHeader
+{
+    char magic[4];
+    quint32 byteOrder;
+    quint32 version;
+    quint32 recordCount;
+    quint32 propertyCount;
+    quint32 stringCount;
+    quint32 stringDataSize; // in QChars
+    quint32 reserved;
+};
+
+struct WfbRecord
+{
+    qint32 id;
+    qint32 key;
+    qint32 x;
+    qint32 y;
+    qint32 w;
+    qint32 h;
+    qint32 measuredW;
+    qint32 measuredH;
+    double zOrder;
+    qint32 hasZOrder;
+    qint32 locked;
+    qint32 groupId;
+    quint32 firstProperty;
+    quint32 propertyCount;
+    quint32 reserved;
+};
+
+struct WfbProperty
+{
+    quint32 name;
+    quint32 value;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool BinaryDocument::isBinary(QIODevice& device)
+{
+    return device.peek(4) == QByteArray(WFB_MAGIC, 4);
+}
+
+bool BinaryDocument::isBinaryFileName(const QString& fileName)
+{
+    return QFileInfo(fileName).suffix().compare("wfb", Qt::CaseInsensitive) == 0;
+}
+
+bool readRecords(const uchar* data, qint64 size, QList<ControlRecord>& records)
+{
+    if (size < (qint64)sizeof(WfbHeader))
+        return false;
+    const WfbHeader* header = (const WfbHeader*)data;
+    if (memcmp(header->magic, WFB_MAGIC, 4) != 0 || header->byteOrder != WFB_BYTE_ORDER
+        || header->version > BinaryDocument::Version)
+        return false;
+
+    qint64 recordsOffset = sizeof(WfbHeader);
+    qint64 propertiesOffset = recordsOffset + (qint64)header->recordCount * sizeof(WfbRecord);
+    qint64 offsetsOffset = propertiesOffset + (qint64)header->propertyCount * sizeof(WfbProperty);
+    qint64 charsOffset = offsetsOffset + ((qint64)header->stringCount + 1) * sizeof(quint32);
+    if (charsOffset + (qint64)header->stringDataSize * sizeof(QChar) > size)
+        return false;
+
+    const WfbRecord* wrecords = (const WfbRecord*)(data + recordsOffset);
+    const WfbProperty* wprops = (const WfbProperty*)(data + propertiesOffset);
+    const quint32* offsets = (const quint32*)(data + offsetsOffset);
+    const QChar* chars = (const QChar*)(data + charsOffset);
+
+    // the strings are shared between records (property names mostly), so
+    // each is turned into a QString once.
+    QVector<QString> strings(header->stringCount);
+    for (quint32 i=0; i<header->stringCount; i++)
+    {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header->stringDataSize)
+            return false;
+        strings[i] = QString(chars + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+
+    records.reserve(records.length() + header->recordCount);
+    for (quint32 i=0; i<header->recordCount; i++)
+    {
+        const WfbRecord& w = wrecords[i];
+        if ((quint64)w.firstProperty + w.propertyCount > header->propertyCount)
+            return false;
+        ControlRecord record;
+        record.id = w.id;
+        record.key = w.key;
+        record.x = w.x;
+        record.y = w.y;
+        record.w = w.w;
+        record.h = w.h;
+        record.measuredW = w.measuredW;
+        record.measuredH = w.measuredH;
+        record.zOrder = w.zOrder;
+        record.hasZOrder = (w.hasZOrder != 0);
+        record.locked = w.locked;
+        record.groupId = w.groupId;
+        for (quint32 j=0; j<w.propertyCount; j++)
+        {
+            const WfbProperty& p = wprops[w.firstProperty + j];
+            if (p.name >= header->stringCount || p.value >= header->stringCount)
+                return false;
+            record.properties.append(qMakePair(strings[p.name], strings[p.value]));
+        }
+        records.append(record);
+    }
+    return true;
+}
+
+bool BinaryDocument::read(QFile& file, QList<ControlRecord>& records)
+{
+    qint64 size = file.size();
+    uchar* data = file.map(0, size);
+    if (data != NULL)
+    {
+        bool ok = readRecords(data, size, records);
+        file.unmap(data);
+        return ok;
+    }
+    // not mappable (a pipe, a resource): read it in one go instead.
+    QByteArray bytes = file.readAll();
+    return readRecords((const uchar*)bytes.constData(), bytes.size(), records);
+}
+
+quint32 internString(const QString& s, QHash<QString, quint32>& index, QVector<quint32>& offsets,
+    QString& chars)
+{
+    QHash<QString, quint32>::const_iterator it = index.constFind(s);
+    if (it != index.constEnd())
+        return it.value();
+    quint32 i = offsets.size() - 1;
+    chars += s;
+    offsets.append(chars.length());
+    index.insert(s, i);
+    return i;
+}
+
+bool BinaryDocument::write(QIODevice& device, const QList<ControlRecord>& records)
+{
+    QVector<WfbRecord> wrecords;
+    QVector<WfbProperty> wprops;
+    QHash<QString, quint32> index;
+    QVector<quint32> offsets;
+    QString chars;
+    offsets.append(0);
+
+    wrecords.reserve(records.length());
+    foreach (const ControlRecord& record, records)
+    {
+        WfbRecord w;
+        memset(&w, 0, sizeof(w));
+        w.id = record.id;
+        w.key = record.key;
+        w.x = record.x;
+        w.y = record.y;
+        w.w = record.w;
+        w.h = record.h;
+        w.measuredW = record.measuredW;
+        w.measuredH = record.measuredH;
+        w.zOrder = record.zOrder;
+        w.hasZOrder = record.hasZOrder ? 1 : 0;
+        w.locked = record.locked;
+        w.groupId = record.groupId;
+        w.firstProperty = wprops.size();
+        w.propertyCount = record.properties.length();
+        for (int i=0; i<record.properties.length(); i++)
+        {
+            WfbProperty p;
+            p.name = internString(record.properties[i].first, index, offsets, chars);
+            p.value = internString(record.properties[i].second, index, offsets, chars);
+            wprops.append(p);
+        }
+        wrecords.append(w);
+    }
+
+    WfbHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WFB_MAGIC, 4);
+    header.byteOrder = WFB_BYTE_ORDER;
+    header.version = Version;
+    header.recordCount = wrecords.size();
+    header.propertyCount = wprops.size();
+    header.stringCount = offsets.size() - 1;
+    header.stringDataSize = chars.length();
+
+    QByteArray bytes;
+    bytes.reserve(sizeof(header) + wrecords.size() * sizeof(WfbRecord)
+        + wprops.size() * sizeof(WfbProperty) + offsets.size() * sizeof(quint32)
+        + chars.length() * sizeof(QChar));
+    bytes.append((const char*)&header, sizeof(header));
+    bytes.append((const char*)wrecords.constData(), wrecords.size() * sizeof(WfbRecord));
+    bytes.append((const char*)wprops.constData(), wprops.size() * sizeof(WfbProperty));
+    bytes.append((const char*)offsets.constData(), offsets.size() * sizeof(quint32));
+    bytes.append((const char*)chars.constData(), chars.length() * sizeof(QChar));
+    return device.write(bytes) == bytes.size();
+}
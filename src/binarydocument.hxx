@@ -0,0 +1,30 @@
+#ifndef BINARYDOCUMENT_H
+#define BINARYDOCUMENT_H
+
+#include <QList>
+#include <QString>
+
+class QIODevice;
+class QFile;
+struct ControlRecord;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// the .wfb container: a header, one fixed-size record per control (geometry,
+// z-order, lock, group id), a table of (name, value) property pairs and a
+// string table they index into. the file is memory-mapped on load and the
+// records are read in place, without any text parsing.
+
+class BinaryDocument
+{
+public:
+    enum {Version = 1};
+
+    static bool isBinary(QIODevice& device);
+    static bool isBinaryFileName(const QString& fileName);
+
+    static bool read(QFile& file, QList<ControlRecord>& records);
+    static bool write(QIODevice& device, const QList<ControlRecord>& records);
+};
+
+#endif // BINARYDOCUMENT_H
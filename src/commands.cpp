@@ -60,8 +60,7 @@ RemoveDiagramItemsCommand::~RemoveDiagramItemsCommand()
 
 void RemoveDiagramItemsCommand::undo()
 {
-    foreach (ResizableItem *item, m_items)
-        m_doc->scene()->addItem(item);
+    m_doc->scene()->addItems(m_items);
     m_undoed = true;
 }
 
@@ -100,6 +99,7 @@ bool MoveDiagramItemCommand::mergeWith(const QUndoCommand *command)
 void MoveDiagramItemCommand::undo()
 {
     m_item->setPos(m_oldPos);
+    m_item->invalidateSavedXml();
     if (m_item->scene() != NULL)
         m_item->scene()->update();
 }
@@ -108,6 +108,7 @@ void MoveDiagramItemCommand::redo()
 {
     if (m_item->scene() != NULL)
         m_item->setPos(m_newPos);
+    m_item->invalidateSavedXml();
 
     //QString s = ("Move id(%1) from (%2,%3) to (%3,%4)");
     //int id = -1;
@@ -166,6 +167,7 @@ void ResizeDiagramItemCommand::undo()
         DiagramItemGroup* ditem = qgraphicsitem_cast<DiagramItemGroup*>(m_item);
         ditem->resizeChildren(m_newPos);
     }
+    m_item->invalidateSavedXml();
     if (m_item->scene() != NULL)
         m_item->scene()->update();
 }
@@ -178,6 +180,7 @@ void ResizeDiagramItemCommand::redo()
         DiagramItemGroup* ditem = qgraphicsitem_cast<DiagramItemGroup*>(m_item);
         ditem->resizeChildren(m_oldPos);
     }
+    m_item->invalidateSavedXml();
     if (m_item->scene() != NULL)
         m_item->scene()->update();
 
@@ -234,8 +237,7 @@ CutCommand::~CutCommand()
 
 void CutCommand::undo()
 {
-    foreach (QGraphicsItem *item, m_items)
-        m_scene->addItem(item);
+    m_scene->addItems(m_items);
     m_undoed = true;
 }
 
@@ -286,11 +288,10 @@ void PasteCommand::undo()
 void PasteCommand::redo()
 {
     m_groups.clear();
-    foreach (QGraphicsItem *item, m_items)
-    {
-        if (ResizableItem::isResizableItem(item))
-            m_scene->addItemOnTop((ResizableItem*)item);
-    }
+    QList<ResizableItem*> items;
+    foreach (DiagramItem *item, m_items)
+        items.append(item);
+    m_scene->addItemsOnTop(items);
     foreach (int group, m_groupMap.keys())
         m_groups.append(m_scene->createItemGroup(m_groupMap[group]));
     m_undoed = false;
@@ -403,20 +404,24 @@ LockCommand::LockCommand(QList<ResizableItem*> items, QUndoCommand *parent)
 
 void LockItems(QList<ResizableItem*> items)
 {
+    if (items.length() == 0)
+        return;
+    DiagramScene* scene = (DiagramScene*)(items[0]->scene());
+    if (scene != NULL)
+        scene->setItemsSelected(items, false);
     foreach (ResizableItem *item, items)
-    {
-        item->setSelected(false);
         item->setLocked(true);
-    }
 }
 
 void UnlockItems(QList<ResizableItem*> items, bool selectedAfterUnlock)
 {
+    if (items.length() == 0)
+        return;
     foreach (ResizableItem *item, items)
-    {
         item->setLocked(false);
-        item->setSelected(selectedAfterUnlock);
-    }
+    DiagramScene* scene = (DiagramScene*)(items[0]->scene());
+    if (scene != NULL)
+        scene->setItemsSelected(items, selectedAfterUnlock);
 }
 
 void LockCommand::undo()
@@ -470,17 +475,14 @@ void MoveFront(QList<ResizableItem*> items)
     scene = (DiagramScene*)(items[0]->scene());
     if (scene == NULL)
         return;
-    qreal maxzInAll = 0.0;
-    int count = scene->topLevelSortedItems().length();
-    if (count > 0)
-        maxzInAll = scene->topLevelSortedItems()[count - 1]->zValue();
-    maxzInAll += 0.1;
+    qreal maxzInAll = scene->topZValue() + 0.1;
 
     qreal minzInItems = items[0]->zValue();
     foreach (ResizableItem* item, items)
     {
         qreal z = maxzInAll + (item->zValue() - minzInItems);
         item->setZValue(z);
+        item->invalidateSavedXml();
         if (item->type() == DiagramItemGroup::Type)
         {
             DiagramItemGroup* g = (DiagramItemGroup*)item;
@@ -499,16 +501,14 @@ void MoveBack(QList<ResizableItem*> items)
     scene = (DiagramScene*)(items[0]->scene());
     if (scene == NULL)
         return;
-    qreal minzInAll = 0.0;
-    if (scene->topLevelSortedItems().length() > 0)
-        minzInAll = scene->topLevelSortedItems()[0]->zValue();
-    minzInAll -= 0.1;
+    qreal minzInAll = scene->bottomZValue() - 0.1;
 
     qreal maxzInItems = items[items.length() -1]->zValue();
     foreach (ResizableItem* item, items)
     {
         qreal z = minzInAll - (maxzInItems - item->zValue());
         item->setZValue(z);
+        item->invalidateSavedXml();
         if (item->type() == DiagramItemGroup::Type)
         {
             DiagramItemGroup* g = (DiagramItemGroup*)item;
@@ -525,6 +525,7 @@ void MoveFrontCommand::undo()
     foreach (ResizableItem* item, m_items)
     {
         item->setZValue(m_zValues[i]);
+        item->invalidateSavedXml();
         i++;
     }
 }
@@ -553,6 +554,7 @@ void MoveBackCommand::undo()
     foreach (ResizableItem* item, m_items)
     {
         item->setZValue(m_zValues[i]);
+        item->invalidateSavedXml();
         i++;
     }
 }
@@ -580,25 +582,14 @@ ResizableItem* MoveUp(ResizableItem* item)
 
     if (scene == NULL)
         return NULL;
-    bool isfound = false;
-    int index = 0;
-    foreach (ResizableItem* tempItem, scene->topLevelSortedItems())
-    {
-        if (tempItem == item)
-        {
-            isfound = true;
-            break;
-        }
-        index ++;
-    }
-    if (!isfound)
-        return NULL;
-    if (index >= scene->topLevelSortedItems().length() - 1)
+    ResizableItem* upItem = scene->itemAbove(item);
+    if (upItem == NULL)
         return NULL;
-    ResizableItem* upItem = scene->topLevelSortedItems()[index+1];
     qreal zTemp = item->zValue();
     item->setZValue(upItem->zValue());
     upItem->setZValue(zTemp);
+    item->invalidateSavedXml();
+    upItem->invalidateSavedXml();
     scene->update();
     return upItem;
 }
@@ -610,6 +601,8 @@ void MoveUpCommand::undo()
     qreal zTemp = m_item->zValue();
     m_item->setZValue(m_upItem->zValue());
     m_upItem->setZValue(zTemp);
+    m_item->invalidateSavedXml();
+    m_upItem->invalidateSavedXml();
     m_item->scene()->update();
 }
 
@@ -644,25 +637,14 @@ ResizableItem* MoveDown(ResizableItem* item)
 
     if (scene == NULL)
         return NULL;
-    bool isfound = false;
-    int index = 0;
-    foreach (ResizableItem* tempItem, scene->topLevelSortedItems())
-    {
-        if (tempItem == item)
-        {
-            isfound = true;
-            break;
-        }
-        index ++;
-    }
-    if (!isfound)
-        return NULL;
-    if (index >= scene->topLevelSortedItems().length() || index == 0)
+    ResizableItem* downItem = scene->itemBelow(item);
+    if (downItem == NULL)
         return NULL;
-    ResizableItem* downItem = scene->topLevelSortedItems()[index-1];
     qreal zTemp = item->zValue();
     item->setZValue(downItem->zValue());
     downItem->setZValue(zTemp);
+    item->invalidateSavedXml();
+    downItem->invalidateSavedXml();
     scene->update();
     return downItem;
 }
@@ -674,6 +656,8 @@ void MoveDownCommand::undo()
     qreal zTemp = m_item->zValue();
     m_item->setZValue(m_downItem->zValue());
     m_downItem->setZValue(zTemp);
+    m_item->invalidateSavedXml();
+    m_downItem->invalidateSavedXml();
     m_item->scene()->update();
 }
 
@@ -5,9 +5,26 @@
 #include "document.hxx"
 #include "commands.h"
 #include "itemdata.hxx"
+#include "binarydocument.hxx"
+#include "documentloader.hxx"
+#include "imageexport.hxx"
+#include "vectorexport.hxx"
 
 const qreal GRIPSIZE = 6.0;
 const qreal MIN_SIZE = 20.0;
+const int BULK_INSERT_THRESHOLD = 100;
+const qreal Z_STEP = 0.1;
+const qreal SNAP_TOLERANCE = 5;
+const int GRID_SIZE = 50;
+// z-values are never renumbered: adding an item on top, or moving items to
+// the front or back, takes the z one Z_STEP past the current top (bottom),
+// and undo commands keep the absolute values they captured. a billion such
+// operations stay within 1e8, where a double still resolves Z_STEP
+// exactly enough; the overlay sits above anything reachable.
+const qreal OVERLAY_Z = 1e12;
+const int BACKGROUND_TILE_SIZE = 256;
+const int BACKGROUND_TILE_CACHE = 128;
+const qreal SNAP_GUIDE_MARGIN = 2;
 
 QString s_empty;
 QString s_key[] = {
@@ -157,97 +174,158 @@ QStringList DiagramLibrary::mimeTypes() const
 
 ///////////////////////////////////////////////////////////////////////////////
 
-Grip::Grip(qreal len, PosType pos, QGraphicsItem *parent)
-    :QGraphicsRectItem(0,0,len,len,parent), m_posType(pos), m_size(len)
+SelectionOverlay::SelectionOverlay()
+    : m_dirty(true)
 {
-    setAcceptsHoverEvents(true);
-    setVisible(false);
-    setPos();
+    setAcceptedMouseButtons(0);
+    setZValue(OVERLAY_Z);
 }
 
-Grip::~Grip()
+QRectF SelectionOverlay::handleRect(Handle handle, const QSizeF& size)
 {
-}
-
-void Grip::hoverEnterEvent(QGraphicsSceneHoverEvent* event)
-{
-    switch(m_posType)
+    qreal w = size.width(), h = size.height();
+    qreal x = 0, y = 0;
+    switch (handle)
     {
     case NorthMiddle:
+        x = w / 2 - GRIPSIZE / 2; y = -GRIPSIZE;
+        break;
     case SouthMiddle:
-        setCursor(Qt::SizeVerCursor);
+        x = w / 2 - GRIPSIZE / 2; y = h;
         break;
     case EastMiddle:
+        x = w; y = h / 2 - GRIPSIZE / 2;
+        break;
     case WestMiddle:
-        setCursor(Qt::SizeHorCursor);
+        x = -GRIPSIZE; y = h / 2 - GRIPSIZE / 2;
         break;
     case NorthWest:
+        x = -GRIPSIZE; y = -GRIPSIZE;
+        break;
     case SouthEast:
-        setCursor(Qt::SizeFDiagCursor);
+        x = w; y = h;
         break;
     case NorthEast:
+        x = w; y = -GRIPSIZE;
+        break;
     case SouthWest:
-        setCursor(Qt::SizeBDiagCursor);
+        x = -GRIPSIZE; y = h;
         break;
     default:
         break;
     }
-    QGraphicsRectItem::hoverEnterEvent(event);
+    return QRectF(x, y, GRIPSIZE, GRIPSIZE);
 }
 
-void Grip::hoverLeaveEvent(QGraphicsSceneHoverEvent * event)
+bool SelectionOverlay::hasHandle(ResizableItem* item, Handle handle)
 {
-    QGraphicsRectItem::hoverLeaveEvent(event);
+    ResizeMode mode = ResizeModeAll;
+    if (item->type() == DiagramItem::Type)
+        mode = ((DiagramItem*)item)->itemData()->resizeMode();
+    if (mode == ResizeModeNone)
+        return false;
+    if (mode == ResizeModeHorz)
+        return handle == EastMiddle || handle == WestMiddle;
+    if (mode == ResizeModeVert)
+        return handle == NorthMiddle || handle == SouthMiddle;
+    return true;
 }
 
-void Grip::setPos()
+Qt::CursorShape SelectionOverlay::handleCursor(Handle handle)
 {
-    const QRectF parentRect = parentItem()->boundingRect();
-    qreal x = 0, y = 0;
-    switch(m_posType){
+    switch (handle)
+    {
     case NorthMiddle:
-        x = parentRect.width() / 2 - m_size / 2;
-        y = 0;
-        break;
     case SouthMiddle:
-        x = parentRect.width() / 2 - m_size / 2;
-        y = parentRect.height() - m_size;
-        break;
+        return Qt::SizeVerCursor;
     case EastMiddle:
-        x = parentRect.width() - m_size;
-        y = parentRect.height() / 2 - m_size / 2;
-        break;
     case WestMiddle:
-        x = 0;
-        y = parentRect.height() / 2 - m_size / 2;
-        break;
+        return Qt::SizeHorCursor;
     case NorthWest:
-        x = 0;
-        y = 0;
-        break;
     case SouthEast:
-        x = parentRect.width() - m_size;
-        y = parentRect.height() - m_size;
-        break;
+        return Qt::SizeFDiagCursor;
     case NorthEast:
-        x = parentRect.width() - m_size;
-        y = 0;
-        break;
     case SouthWest:
-        x = 0;
-        y = parentRect.height() - m_size;
-        break;
+        return Qt::SizeBDiagCursor;
     default:
-        break;
+        return Qt::ArrowCursor;
     }
-    QGraphicsItem::setPos(x - m_size, y - m_size);
 }
 
-///////////////////////////////////////////////////////////////////////////////
+SelectionOverlay::Handle SelectionOverlay::handleAt(ResizableItem* item, const QPointF& scenePos)
+{
+    if (!item->isSelected())
+        return NoHandle;
+    QPointF p = item->mapFromScene(scenePos);
+    QSizeF size = item->size();
+    for (int i=0; i<HandleLast; i++)
+    {
+        Handle handle = (Handle)i;
+        if (hasHandle(item, handle) && handleRect(handle, size).contains(p))
+            return handle;
+    }
+    return NoHandle;
+}
+
+void SelectionOverlay::invalidate()
+{
+    if (m_dirty)
+        return;
+    prepareGeometryChange();
+    m_dirty = true;
+}
+
+void SelectionOverlay::refresh() const
+{
+    m_dirty = false;
+    m_handles.clear();
+    m_boundingRect = QRectF();
+    if (scene() == NULL)
+        return;
+    foreach (QGraphicsItem* gi, scene()->selectedItems())
+    {
+        if (!ResizableItem::isResizableItem(gi))
+            continue;
+        ResizableItem* item = (ResizableItem*)gi;
+        QSizeF size = item->size();
+        for (int i=0; i<HandleLast; i++)
+        {
+            if (!hasHandle(item, (Handle)i))
+                continue;
+            QRectF rc = item->mapRectToScene(handleRect((Handle)i, size));
+            m_handles.append(rc);
+            m_boundingRect |= rc;
+        }
+    }
+    // room for the pen
+    if (!m_boundingRect.isNull())
+        m_boundingRect.adjust(-1, -1, 1, 1);
+}
+
+QRectF SelectionOverlay::boundingRect() const
+{
+    if (m_dirty)
+        refresh();
+    return m_boundingRect;
+}
+
+void SelectionOverlay::paint(QPainter *painter, const QStyleOptionGraphicsItem *, QWidget *)
+{
+    if (m_dirty)
+        refresh();
+    painter->setPen(QPen(Qt::black, 0));
+    painter->setBrush(Qt::NoBrush);
+    foreach (const QRectF& rc, m_handles)
+        painter->drawRect(rc);
+}
+
+///////
 
 ResizableItemHelper::ResizableItemHelper(ResizableItem* item)
 {
     m_item = item;
+    m_mouseMode = Move;
+    m_curHandle = SelectionOverlay::NoHandle;
 }
 
 QRectF ResizableItemHelper::boundingRect() const
@@ -265,18 +343,17 @@ QPainterPath ResizableItemHelper::shape() const
     return path;
 }
 
-void ResizableItemHelper::paint(QPainter*, const QStyleOptionGraphicsItem *option, QWidget *)
+void ResizableItemHelper::paint(QPainter*, const QStyleOptionGraphicsItem *, QWidget *)
 {
-    if (option->state & QStyle::State_Selected)
-        showGrips(true);
-    else
-        showGrips(false);
 }
 
 bool ResizableItemHelper::mousePressEvent(QGraphicsSceneMouseEvent *event)
 {
-    m_curGrip = qgraphicsitem_cast<Grip*>(m_item->scene()->itemAt(event->scenePos()));
-    if(m_curGrip)
+    m_curHandle = SelectionOverlay::NoHandle;
+    DiagramScene* scene = qobject_cast<DiagramScene*>(m_item->scene());
+    if (scene != NULL)
+        m_curHandle = scene->selectionOverlay()->handleAt(m_item, event->scenePos());
+    if (m_curHandle != SelectionOverlay::NoHandle)
     {
         m_mouseMode = Resize;
         m_lastPoint.setX(event->scenePos().x());
@@ -301,35 +378,53 @@ bool ResizableItemHelper::mouseMoveEvent(QGraphicsSceneMouseEvent *event)
         QPointF curPoint(event->scenePos());
         qreal wChanging = curPoint.x()-m_lastPoint.x(), hChanging = curPoint.y()-m_lastPoint.y();
         qreal curX = 0, curY = 0, curWidth = m_size.width(), curHeight = m_size.height();
-        switch(m_curGrip->posType())
+        switch(m_curHandle)
         {
-        case Grip::NorthMiddle:
+        case SelectionOverlay::NorthMiddle:
             curY += hChanging; curHeight-=hChanging;
             break;
-        case Grip::SouthMiddle:
+        case SelectionOverlay::SouthMiddle:
             curHeight+=hChanging;
             break;
-        case Grip::EastMiddle:
+        case SelectionOverlay::EastMiddle:
             curWidth+=wChanging;
             break;
-        case Grip::WestMiddle:
+        case SelectionOverlay::WestMiddle:
             curX+=wChanging; curWidth-=wChanging;
             break;
-        case Grip::NorthWest:
+        case SelectionOverlay::NorthWest:
             curX+=wChanging; curY+=hChanging; curWidth-=wChanging; curHeight-=hChanging;
             break;
-        case Grip::SouthEast:
+        case SelectionOverlay::SouthEast:
             curWidth+=wChanging; curHeight+=hChanging;
             break;
-        case Grip::NorthEast:
+        case SelectionOverlay::NorthEast:
             curY+=hChanging; curWidth+=wChanging; curHeight-=hChanging;
             break;
-        case Grip::SouthWest:
+        case SelectionOverlay::SouthWest:
             curX+=wChanging; curWidth-=wChanging; curHeight+=hChanging;
             break;
         default:
             break;
         }
+
+        // match the width or height of another item; west and north grips
+        // keep the opposite edge in place
+        SelectionOverlay::Handle t = m_curHandle;
+        bool west = (t == SelectionOverlay::WestMiddle || t == SelectionOverlay::NorthWest || t == SelectionOverlay::SouthWest);
+        bool north = (t == SelectionOverlay::NorthMiddle || t == SelectionOverlay::NorthWest || t == SelectionOverlay::NorthEast);
+        bool changesW = (t != SelectionOverlay::NorthMiddle && t != SelectionOverlay::SouthMiddle);
+        bool changesH = (t != SelectionOverlay::EastMiddle && t != SelectionOverlay::WestMiddle);
+        qreal w = curWidth, h = curHeight;
+        DiagramScene* scene = qobject_cast<DiagramScene*>(m_item->scene());
+        if (scene != NULL && scene->matchSize(m_item, w, h, changesW, changesH))
+        {
+            if (west) curX -= w - curWidth;
+            if (north) curY -= h - curHeight;
+            curWidth = w;
+            curHeight = h;
+        }
+
         if(curWidth < MIN_SIZE ||curHeight <MIN_SIZE)
             return true;
         m_rubberBandRect->setRect(curX,curY,curWidth,curHeight);
@@ -363,53 +458,17 @@ bool ResizableItemHelper::mouseReleaseEvent(QGraphicsSceneMouseEvent *)
         return false;
     }
 }
-void ResizableItemHelper::showGrips(bool visible)
-{
-    ResizeMode mode = ResizeModeAll;
-    if (m_item->type() == DiagramItem::Type)
-        mode = ((DiagramItem*)m_item)->itemData()->resizeMode();
-    if (mode == ResizeModeNone)
-        return;
 
-    if (m_grips.length() == 0)
-        createGrips();
-
-    for(int i = 0; i < m_grips.count(); i++)
-    {
-        Grip::PosType type = m_grips.at(i)->posType();
-        if (mode == ResizeModeHorz)
-        {
-            if (type != Grip::EastMiddle && type != Grip::WestMiddle)
-                continue;
-        }
-        if (mode == ResizeModeVert)
-        {
-            if (type != Grip::NorthMiddle && type != Grip::SouthMiddle)
-                continue;
-        }
-        m_grips.at(i)->setPos();
-        m_grips.at(i)->setVisible(visible);
-    }
-}
-
-void ResizableItemHelper::createGrips()
+void ResizableItemHelper::hoverMoveEvent(QGraphicsSceneHoverEvent *event)
 {
-    Grip *north_middle = new Grip(GRIPSIZE,Grip::NorthMiddle,m_item);
-    m_grips.append(north_middle);
-    Grip *north_east = new Grip(GRIPSIZE,Grip::NorthEast,m_item);
-    m_grips.append(north_east);
-    Grip *north_west = new Grip(GRIPSIZE,Grip::NorthWest,m_item);
-    m_grips.append(north_west);
-    Grip *south_middle = new Grip(GRIPSIZE,Grip::SouthMiddle,m_item);
-    m_grips.append(south_middle);
-    Grip *south_east = new Grip(GRIPSIZE,Grip::SouthEast,m_item);
-    m_grips.append(south_east);
-    Grip *south_west = new Grip(GRIPSIZE,Grip::SouthWest,m_item);
-    m_grips.append(south_west);
-    Grip *east_middle = new Grip(GRIPSIZE,Grip::EastMiddle,m_item);
-    m_grips.append(east_middle);
-    Grip *west_middle = new Grip(GRIPSIZE,Grip::WestMiddle,m_item);
-    m_grips.append(west_middle);
+    SelectionOverlay::Handle handle = SelectionOverlay::NoHandle;
+    DiagramScene* scene = qobject_cast<DiagramScene*>(m_item->scene());
+    if (scene != NULL)
+        handle = scene->selectionOverlay()->handleAt(m_item, event->scenePos());
+    if (handle == SelectionOverlay::NoHandle)
+        m_item->unsetCursor();
+    else
+        m_item->setCursor(SelectionOverlay::handleCursor(handle));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -426,6 +485,81 @@ void ResizableItem::setLocked(bool v)
         setFlags (flags() | QGraphicsItem::ItemIsMovable | QGraphicsItem::ItemIsSelectable
             | QGraphicsItem::ItemIsFocusable);
     }
+    invalidateSavedXml();
+}
+
+void ResizableItem::setSize(QSizeF s)
+{
+    m_helper->setSize(s);
+    DiagramScene* sc = qobject_cast<DiagramScene*>(scene());
+    if (sc != NULL)
+        sc->updateSnapGeometry(this);
+}
+
+ResizableItem::~ResizableItem()
+{
+    DiagramScene* s = qobject_cast<DiagramScene*>(scene());
+    if (s != NULL)
+    {
+        s->unindexItem(this);
+        s->raiseItemRemoved(this);
+    }
+}
+
+QVariant ResizableItem::itemChange(GraphicsItemChange change, const QVariant &value)
+{
+    switch (change)
+    {
+    case QGraphicsItem::ItemSceneChange:
+        {
+            DiagramScene* s = qobject_cast<DiagramScene*>(scene());
+            if (s != NULL)
+            {
+                s->unindexItem(this);
+                s->raiseItemRemoved(this);
+            }
+        }
+        break;
+    case QGraphicsItem::ItemSceneHasChanged:
+    case QGraphicsItem::ItemParentHasChanged:
+        {
+            DiagramScene* s = qobject_cast<DiagramScene*>(scene());
+            if (s != NULL)
+            {
+                s->reindexItem(this);
+                s->updateSnapGeometry(this);
+            }
+        }
+        break;
+    case QGraphicsItem::ItemZValueHasChanged:
+        {
+            DiagramScene* s = qobject_cast<DiagramScene*>(scene());
+            if (s != NULL)
+                s->reindexItem(this);
+        }
+        break;
+    case QGraphicsItem::ItemSelectedChange:
+        // the bounding rect grows by the handles while selected
+        prepareGeometryChange();
+        break;
+    case QGraphicsItem::ItemSelectedHasChanged:
+        {
+            DiagramScene* s = qobject_cast<DiagramScene*>(scene());
+            if (s != NULL)
+                s->touchSelection();
+        }
+        break;
+    case QGraphicsItem::ItemPositionHasChanged:
+        {
+            DiagramScene* s = qobject_cast<DiagramScene*>(scene());
+            if (s != NULL)
+                s->updateSnapGeometry(this);
+        }
+        break;
+    default:
+        break;
+    }
+    return QGraphicsItem::itemChange(change, value);
 }
 
 bool ResizableItem::locked()
@@ -436,23 +570,40 @@ bool ResizableItem::locked()
 
 ///////////////////////////////////////////////////////////////////////////////
 
-DiagramItem::DiagramItem(DiagramKey key, QPointF pos, QGraphicsItem *parent) 
+DiagramItem::DiagramItem(DiagramKey key, QPointF pos, QGraphicsItem *parent, LayoutContext* context) 
     : ResizableItem(parent)
 {
+    createData(key, pos, context);
+    m_data->init();
+    setSize(m_data->mesuredSize());
+}
+
+DiagramItem::DiagramItem(const ControlRecord& record, LayoutContext* context)
+    : ResizableItem(0)
+{
+    createData((DiagramKey)record.key, QPointF(0, 0), context);
+    m_data->init(record);
+}
+
+void DiagramItem::createData(DiagramKey key, QPointF pos, LayoutContext* context)
+{
+    if (context == NULL)
+        context = LayoutContext::defaultContext();
     setAcceptDrops(true);
     setAcceptsHoverEvents(true);
     setFlags(QGraphicsItem::ItemIsMovable | QGraphicsItem::ItemIsSelectable
-        | QGraphicsItem::ItemIsFocusable);
+        | QGraphicsItem::ItemIsFocusable | QGraphicsItem::ItemSendsGeometryChanges
+        | QGraphicsItem::ItemUsesExtendedStyleOption);
     m_key = key;
     m_helper = new ResizableItemHelper(this);
     setPos(pos.x(), pos.y());
     switch (m_key)
     {
     case KeyAccordion:
-        m_data = new Accordion(this);
+        m_data = new Accordion(this, context);
         break;
     case KeyAlertBox:
-        m_data = new AlertBox(this);
+        m_data = new AlertBox(this, context);
         break;
     case KeyCalendar:
     case KeyChartBar:
@@ -467,23 +618,21 @@ DiagramItem::DiagramItem(DiagramKey key, QPointF pos, QGraphicsItem *parent)
     case KeyVertSplitter_Separator_DragBar:
     case KeyVolumeSlider:
     case KeyWebcam:
-        m_data = new ImageItemData(this);
+        m_data = new ImageItemData(this, context);
         break;
     case KeyBreadcrumbs:
-        m_data = new Breadcrumbs(this);
+        m_data = new Breadcrumbs(this, context);
         break;
     case KeyBrowserWindow:
-        m_data = new BrowserWindow(this);
+        m_data = new BrowserWindow(this, context);
         break;
     case KeyButton:
-        m_data = new Button(this);
+        m_data = new Button(this, context);
         break;
     default: 
-        m_data = new NotImplementedYet(this);
+        m_data = new NotImplementedYet(this, context);
         break;
     }
-    m_data->init();
-    setSize(m_data->mesuredSize());
 }
 
 DiagramItem::~DiagramItem()
@@ -526,6 +675,11 @@ void DiagramItem::setSizeAndNotify(QSizeF sz)
     if (m_data) m_data->posRect_changed();
 }
 
+void DiagramItem::invalidateSavedXml()
+{
+    if (m_data) m_data->invalidateXmlCache();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 DiagramItemGroup::DiagramItemGroup(QGraphicsItem *parent) : ResizableItem(parent)
@@ -533,7 +687,7 @@ DiagramItemGroup::DiagramItemGroup(QGraphicsItem *parent) : ResizableItem(parent
     setAcceptDrops(true);
     setAcceptsHoverEvents(true);
     setFlags(QGraphicsItem::ItemIsMovable | QGraphicsItem::ItemIsSelectable
-        | QGraphicsItem::ItemIsFocusable);
+        | QGraphicsItem::ItemIsFocusable | QGraphicsItem::ItemSendsGeometryChanges);
     m_helper = new ResizableItemHelper(this); // will set later.
 }
 
@@ -576,23 +730,41 @@ void DiagramItemGroup::subPaint(QPainter *, const QStyleOptionGraphicsItem *)
 {
 }
 
+void DiagramItemGroup::invalidateSavedXml()
+{
+    // children are saved with the group offset and the group z-order
+    foreach (DiagramItem* ditem, diagramItems())
+        ditem->invalidateSavedXml();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 DiagramScene::DiagramScene(QObject *parent)
-    : QGraphicsScene(parent), m_showGrid(true)
+    : QGraphicsScene(parent), m_showGrid(true), m_backgroundTiles(BACKGROUND_TILE_CACHE)
 {
     m_nextId = 0;
-    m_snapOffset = 0;
+    m_selectionStamp = 0;
+    m_overlay = new SelectionOverlay();
+    addItem(m_overlay);
+    connect(this, SIGNAL(selectionChanged()), this, SLOT(touchSelection()));
 }
 
-void DiagramScene::drawBackground(QPainter *painter, const QRectF &rect)
+DiagramScene::~DiagramScene()
 {
-    if (!m_showGrid)
-        return;
+    // the items are deleted by ~QGraphicsScene, after the index is gone
+    delete m_overlay;
+    m_overlay = NULL;
+    m_zOrder.clear();
+    m_indexedZ.clear();
+    m_snapIndex.clear();
+}
 
+// renders the gradient and the grid for a rect of the scene
+void DiagramScene::drawGrid(QPainter *painter, const QRectF &rect)
+{
     QGraphicsScene::drawBackground(painter, rect);
 
-    const int gridSize = 50;
+    const int gridSize = GRID_SIZE;
     const int realLeft = static_cast<int>(floor(rect.left()));
     const int realRight = static_cast<int>(ceil(rect.right()));
     const int realTop = static_cast<int>(floor(rect.top()));
@@ -614,14 +786,91 @@ void DiagramScene::drawBackground(QPainter *painter, const QRectF &rect)
     painter->setPen(QPen(Qt::lightGray, 0.0));
     painter->drawLine(0, realTop, 0, realBottom);
     painter->drawLine(realLeft, 0, realRight, 0);
+}
 
-    if (!qFuzzyIsNull(m_snapOffset))
+void DiagramScene::drawBackground(QPainter *painter, const QRectF &rect)
+{
+    if (!m_showGrid)
+        return;
+
+    // tiles only line up under a plain scale; anything else draws directly
+    QTransform t = painter->worldTransform();
+    qreal scale = t.m11() * painter->device()->devicePixelRatioF();
+    if (t.type() > QTransform::TxScale || t.m11() != t.m22() || scale <= 0)
     {
-        painter->setPen(QColor(m_snapHorz ? 255 : 0, m_snapHorz ? 0 : 255, 0));
-        if (m_snapHorz)
-            painter->drawLine(m_snapLine, realTop, m_snapLine, realBottom);
-        else
-            painter->drawLine(realLeft, m_snapLine, realRight, m_snapLine);
+        drawGrid(painter, rect);
+        return;
+    }
+
+    if (m_tileBrush != backgroundBrush())
+    {
+        m_backgroundTiles.clear();
+        m_tileBrush = backgroundBrush();
+    }
+
+    // a tile is BACKGROUND_TILE_SIZE device pixels square at every zoom
+    // level, so the tiles of a level meet on whole pixels
+    qreal dpr = painter->device()->devicePixelRatioF();
+    qreal extent = BACKGROUND_TILE_SIZE / scale;
+    int scaleKey = qRound(scale * 1000);
+    int left = qFloor(rect.left() / extent), right = qFloor(rect.right() / extent);
+    int top = qFloor(rect.top() / extent), bottom = qFloor(rect.bottom() / extent);
+    for (int ty = top; ty <= bottom; ty++)
+    {
+        for (int tx = left; tx <= right; tx++)
+        {
+            QRectF tileRect(tx * extent, ty * extent, extent, extent);
+            BackgroundTileKey key(tx, ty, scaleKey);
+            QPixmap* tile = m_backgroundTiles.object(key);
+            if (tile == NULL)
+            {
+                tile = new QPixmap(BACKGROUND_TILE_SIZE, BACKGROUND_TILE_SIZE);
+                tile->fill(Qt::transparent);
+                QPainter p(tile);
+                p.scale(scale, scale);
+                p.translate(-tileRect.topLeft());
+                drawGrid(&p, tileRect);
+                p.end();
+                tile->setDevicePixelRatio(dpr);
+                m_backgroundTiles.insert(key, tile);
+            }
+            painter->drawPixmap(tileRect, *tile, QRectF(tile->rect()));
+        }
+    }
+}
+
+// the snap guides of a drag, drawn over the items and limited to the scene rect
+void DiagramScene::drawForeground(QPainter *painter, const QRectF &rect)
+{
+    if (m_snap.isNull())
+        return;
+    QRectF rc = rect & sceneRect();
+
+    painter->setPen(QColor(255, 0, 0));
+    foreach (qreal x, m_snap.xLines)
+        painter->drawLine(QPointF(x, rc.top()), QPointF(x, rc.bottom()));
+    painter->setPen(QColor(0, 255, 0));
+    foreach (qreal y, m_snap.yLines)
+        painter->drawLine(QPointF(rc.left(), y), QPointF(rc.right(), y));
+    if (!m_snap.spacingMarks.isEmpty())
+    {
+        painter->setPen(QPen(QColor(255, 0, 255), 0.0));
+        painter->drawLines(m_snap.spacingMarks);
+    }
+}
+
+// repaints just the strips under the guides of a snap result
+void DiagramScene::updateSnapGuides(const SnapResult& snap)
+{
+    QRectF rc = sceneRect();
+    foreach (qreal x, snap.xLines)
+        update(QRectF(x - SNAP_GUIDE_MARGIN, rc.top(), SNAP_GUIDE_MARGIN * 2, rc.height()));
+    foreach (qreal y, snap.yLines)
+        update(QRectF(rc.left(), y - SNAP_GUIDE_MARGIN, rc.width(), SNAP_GUIDE_MARGIN * 2));
+    foreach (const QLineF& line, snap.spacingMarks)
+    {
+        update(QRectF(line.p1(), line.p2()).normalized().adjusted(-SNAP_GUIDE_MARGIN, -SNAP_GUIDE_MARGIN,
+            SNAP_GUIDE_MARGIN, SNAP_GUIDE_MARGIN));
     }
 }
 
@@ -630,6 +879,11 @@ void DiagramScene::raiseItemMoved(ResizableItem *item, const QPointF &oldPos, co
     emit itemMoved(item, oldPos, newPos);
 }
 
+void DiagramScene::raiseItemRemoved(ResizableItem *item)
+{
+    emit itemRemoved(item);
+}
+
 void DiagramScene::raiseItemResized(ResizableItem *item, const QRectF &oldPos, const QRectF &newPos)
 {
     emit itemResized(item, oldPos, newPos);
@@ -678,6 +932,7 @@ DiagramItemGroup *DiagramScene::createItemGroup(const QList<ResizableItem *> &it
     group->setZValue(z);
     group->setLocked(false);
     group->setPosRect(rc);
+    group->invalidateSavedXml();
     return group;
 }
 
@@ -685,7 +940,6 @@ void DiagramScene::destroyItemGroup(DiagramItemGroup *group)
 {
     bool oldSelected = group->isSelected();
     group->setSelected(false);
-    group->resizeHelper()->showGrips(false);
     foreach (DiagramItem *item, group->diagramItems())
     {
         item->setParentItem(0);
@@ -714,28 +968,135 @@ void DiagramScene::sort(QList<DiagramItem*> & r)
 
 QList<ResizableItem*> DiagramScene::topLevelSortedItems()
 {
-    QList<ResizableItem*> r;
-    foreach(QGraphicsItem* item, items())
-    {
-        if (ResizableItem::isResizableItem(item) && item->parentItem() == NULL)
-            r.append((ResizableItem*)item);
-    }
-    qSort(r.begin(), r.end(), zValueLessThan);
-    return r;
+    return m_zOrder.values();
 }
 
+// group members follow their group, in their own z-order
 QList<DiagramItem*> DiagramScene::sortedDiagramItems()
 {
     QList<DiagramItem*> r;
-    foreach(QGraphicsItem* item, items())
+    foreach (ResizableItem* item, m_zOrder)
     {
         if (item->type() == DiagramItem::Type)
             r.append((DiagramItem*)item);
+        else if (item->type() == DiagramItemGroup::Type)
+            r.append(((DiagramItemGroup*)item)->diagramItems());
     }
-    qSort(r.begin(), r.end(), zValueLessThan);
     return r;
 }
 
+// applies a selection change to many items as one transaction: the
+// per-item selectionChanged signals are held back and a single one is
+// emitted at the end, if anything changed at all.
+void DiagramScene::setItemsSelected(const QList<ResizableItem*>& items, bool selected)
+{
+    bool changed = false;
+    bool blocked = blockSignals(true);
+    foreach (ResizableItem* item, items)
+    {
+        if (item->isSelected() == selected)
+            continue;
+        if (selected && (item->flags() & QGraphicsItem::ItemIsSelectable) == 0)
+            continue;
+        item->setSelected(selected);
+        changed = true;
+    }
+    blockSignals(blocked);
+    if (changed)
+    {
+        touchSelection();
+        emit selectionChanged();
+    }
+}
+
+void DiagramScene::selectAllItems()
+{
+    setItemsSelected(topLevelSortedItems(), true);
+}
+
+void DiagramScene::reindexItem(ResizableItem* item)
+{
+    unindexItem(item);
+    if (item->isSelected())
+        touchSelection();
+    if (item->scene() != this || item->parentItem() != NULL)
+        return;
+    m_zOrder.insert(ZOrderKey(item->zValue(), item), item);
+    m_indexedZ.insert(item, item->zValue());
+}
+
+void DiagramScene::unindexItem(ResizableItem* item)
+{
+    // no type() check: this also runs from ~ResizableItem
+    m_snapIndex.remove((DiagramItem*)item);
+    if (item->isSelected())
+        touchSelection();
+    QHash<ResizableItem*, qreal>::iterator it = m_indexedZ.find(item);
+    if (it == m_indexedZ.end())
+        return;
+    m_zOrder.remove(ZOrderKey(it.value(), item));
+    m_indexedZ.erase(it);
+}
+
+// keeps the snap index on scene coordinates: a group passes its change on
+// to its members.
+void DiagramScene::updateSnapGeometry(ResizableItem* item)
+{
+    if (item->isSelected())
+        touchSelection();
+    if (item->type() == DiagramItemGroup::Type)
+    {
+        foreach (QGraphicsItem* child, item->childItems())
+        {
+            if (child->type() == DiagramItem::Type)
+                updateSnapGeometry((DiagramItem*)child);
+        }
+        return;
+    }
+    if (item->type() != DiagramItem::Type)
+        return;
+    if (item->scene() == this)
+        m_snapIndex.insert((DiagramItem*)item, QRectF(item->scenePos(), item->size()));
+    else
+        m_snapIndex.remove((DiagramItem*)item);
+}
+
+ResizableItem* DiagramScene::itemAbove(ResizableItem* item)
+{
+    if (!m_indexedZ.contains(item))
+        return NULL;
+    QMap<ZOrderKey, ResizableItem*>::const_iterator it = 
+        m_zOrder.constFind(ZOrderKey(m_indexedZ.value(item), item));
+    ++it;
+    return (it == m_zOrder.constEnd()) ? NULL : it.value();
+}
+
+ResizableItem* DiagramScene::itemBelow(ResizableItem* item)
+{
+    if (!m_indexedZ.contains(item))
+        return NULL;
+    QMap<ZOrderKey, ResizableItem*>::const_iterator it = 
+        m_zOrder.constFind(ZOrderKey(m_indexedZ.value(item), item));
+    if (it == m_zOrder.constBegin())
+        return NULL;
+    --it;
+    return it.value();
+}
+
+qreal DiagramScene::topZValue()
+{
+    if (m_zOrder.isEmpty())
+        return 0;
+    return m_zOrder.lastKey().z;
+}
+
+qreal DiagramScene::bottomZValue()
+{
+    if (m_zOrder.isEmpty())
+        return 0;
+    return m_zOrder.firstKey().z;
+}
+
 QList<ResizableItem*> DiagramScene::selectedSortedItems()
 {
     QList<ResizableItem*> r;
@@ -754,99 +1115,117 @@ QList<ResizableItem*> DiagramScene::selectedSortedItems()
 
 void DiagramScene::addItemOnTop(ResizableItem* item)
 {
-    qreal zValue = 0;
-    if (topLevelSortedItems().length() > 0)
-        zValue = topLevelSortedItems()[topLevelSortedItems().length() - 1]->zValue();
-    zValue += 0.1;
-    item->setZValue(zValue);
-    if (qgraphicsitem_cast<DiagramItem*> (item) != NULL)
-        (qgraphicsitem_cast<DiagramItem*> (item))->setId(m_nextId);
-    m_nextId ++;
-    addItem(item);
+    QList<ResizableItem*> items;
+    items.append(item);
+    addItemsOnTop(items);
+}
+
+// stacks the items above everything in the scene, in list order, and
+// gives them new ids. the top z-value is looked up once for the batch.
+void DiagramScene::addItemsOnTop(const QList<ResizableItem*>& items)
+{
+    qreal zValue = topZValue();
+    foreach (ResizableItem* item, items)
+    {
+        zValue += Z_STEP;
+        item->setZValue(zValue);
+        if (qgraphicsitem_cast<DiagramItem*> (item) != NULL)
+            (qgraphicsitem_cast<DiagramItem*> (item))->setId(m_nextId);
+        m_nextId ++;
+        item->invalidateSavedXml();
+    }
+    insertItems(items);
+}
+
+// puts back items that keep their z-values and ids, e.g. on undo.
+void DiagramScene::addItems(const QList<ResizableItem*>& items)
+{
+    insertItems(items);
+}
+
+void DiagramScene::insertItems(const QList<ResizableItem*>& items)
+{
+    // a large batch is cheaper to index in one go: switch the bsp index off
+    // while adding, and let the scene rebuild it once when it is back on.
+    bool rebuildIndex = (itemIndexMethod() == QGraphicsScene::BspTreeIndex)
+        && items.length() >= BULK_INSERT_THRESHOLD;
+    if (rebuildIndex)
+        setItemIndexMethod(QGraphicsScene::NoIndex);
+    foreach (ResizableItem* item, items)
+        addItem(item);
+    if (rebuildIndex)
+        setItemIndexMethod(QGraphicsScene::BspTreeIndex);
 }
 
 void DiagramScene::mouseMoveEvent(QGraphicsSceneMouseEvent *event)
 {
     QGraphicsScene::mouseMoveEvent(event);
 
-    bool hasOldSnapLine = !qFuzzyIsNull(m_snapOffset);
-    m_snapOffset = 0;
-    if (mouseGrabberItem() != NULL)
+    SnapResult oldSnap = m_snap;
+    m_snap = SnapResult();
+    DiagramItem* ditem = qgraphicsitem_cast<DiagramItem*>(mouseGrabberItem());
+    if (ditem != NULL && ditem->resizeHelper()->mouseMode() == ResizableItemHelper::Move)
     {
-        if (qgraphicsitem_cast<DiagramItem*> (mouseGrabberItem()))
-        {
-            DiagramItem* ditem = (DiagramItem*)mouseGrabberItem();
-            foreach(DiagramItem* t, sortedDiagramItems())
-            {
-                if (ditem == t)
-                    continue;
-                qreal x = ditem->posRect().left();
-                qreal y = ditem->posRect().top();
-                qreal x1 = ditem->posRect().right();
-                qreal y1 = ditem->posRect().bottom();
-
-                qreal tx = t->posRect().left();
-                qreal ty = t->posRect().top();
-                qreal tx1 = t->posRect().right();
-                qreal ty1 = t->posRect().bottom();
-                qreal snap = 5;
-
-                if (abs((tx + tx1) / 2 - (x + x1) / 2) < snap)
-                {
-                    m_snapOffset = (tx + tx1) / 2 - (x + x1) / 2;
-                    m_snapLine = (tx + tx1) / 2;
-                    m_snapHorz = true;
-                }
-                if (abs((ty + ty1) / 2 - (y + y1) / 2) < snap)
-                {
-                    m_snapOffset = (ty + ty1) / 2 - (y + y1) / 2;
-                    m_snapLine = (ty + ty1) / 2;
-                    m_snapHorz = false;
-                }
-                if (abs(tx - x) < snap) {m_snapOffset = tx - x; m_snapLine = tx; m_snapHorz = true;}
-                if (abs(tx1 - x) < snap) {m_snapOffset = tx1 - x; m_snapLine = tx1; m_snapHorz = true;}
-                if (abs(tx - x1) < snap) {m_snapOffset = tx - x1; m_snapLine = tx; m_snapHorz = true;}
-                if (abs(tx1 - x1) < snap) {m_snapOffset = tx1 - x1; m_snapLine = tx1; m_snapHorz = true;}
-
-                if (abs(ty - y) < snap) {m_snapOffset = ty - y; m_snapLine = ty; m_snapHorz = false;}
-                if (abs(ty1 - y) < snap) {m_snapOffset = ty1 - y; m_snapLine = ty1; m_snapHorz = false;}
-                if (abs(ty - y1) < snap) {m_snapOffset = ty - y1; m_snapLine = ty; m_snapHorz = false;}
-                if (abs(ty1 - y1) < snap) {m_snapOffset = ty1 - y1; m_snapLine = ty1; m_snapHorz = false;}
-
-                if (!qFuzzyIsNull(m_snapOffset))
-                {
-                    update();
-                    break;
-                }
-            }
-        }
+        m_snap = m_snapIndex.snap(ditem, QRectF(ditem->scenePos(), ditem->size()), 
+            SNAP_TOLERANCE, m_showGrid ? GRID_SIZE : 0);
     }
-    if (qFuzzyIsNull(m_snapOffset) && hasOldSnapLine)
-        update();
+    updateSnapGuides(oldSnap);
+    updateSnapGuides(m_snap);
+}
+
+bool DiagramScene::matchSize(ResizableItem* item, qreal& w, qreal& h, bool matchW, bool matchH)
+{
+    if (item->type() != DiagramItem::Type)
+        return false;
+    bool matched = false;
+    if (matchW)
+        matched |= m_snapIndex.matchWidth((DiagramItem*)item, w, SNAP_TOLERANCE);
+    if (matchH)
+        matched |= m_snapIndex.matchHeight((DiagramItem*)item, h, SNAP_TOLERANCE);
+    return matched;
 }
 
 void DiagramScene::mouseReleaseEvent(QGraphicsSceneMouseEvent *event)
 {
-    DiagramItem* ditem = NULL;
-    if (mouseGrabberItem() != NULL)
-        if (qgraphicsitem_cast<DiagramItem*> (mouseGrabberItem()))
-            ditem = (DiagramItem*)mouseGrabberItem();
-    
-    QGraphicsScene::mouseReleaseEvent(event);
-    if (ditem != NULL)
+    // snap before the item reports its move, so the move command gets
+    // the final position
+    DiagramItem* ditem = qgraphicsitem_cast<DiagramItem*>(mouseGrabberItem());
+    if (ditem != NULL && !m_snap.isNull())
     {
-        if (m_snapHorz)
-            ditem->setPos(ditem->pos().x() + m_snapOffset, ditem->pos().y());
-        else
-            ditem->setPos(ditem->pos().x(), ditem->pos().y() + m_snapOffset);
+        ditem->setPos(ditem->pos() + QPointF(m_snap.dx, m_snap.dy));
+        ditem->invalidateSavedXml();
     }
-    m_snapOffset = 0;
+    SnapResult oldSnap = m_snap;
+    m_snap = SnapResult();
+    m_snapIndex.setDragItems(QList<DiagramItem*>());
+    QGraphicsScene::mouseReleaseEvent(event);
+    updateSnapGuides(oldSnap);
 }
 
 void DiagramScene::mousePressEvent(QGraphicsSceneMouseEvent *event)
 {
     emit endEdit();
     QGraphicsScene::mousePressEvent(event);
+    // what moves stays out of the snap index while it moves: a move drags
+    // the whole selection, a resize only the grabbed item
+    QList<DiagramItem*> dragItems;
+    QGraphicsItem* grabber = mouseGrabberItem();
+    if (grabber != NULL && (grabber->type() == DiagramItem::Type || grabber->type() == DiagramItemGroup::Type))
+    {
+        if (((ResizableItem*)grabber)->resizeHelper()->mouseMode() == ResizableItemHelper::Move)
+        {
+            foreach (QGraphicsItem* item, selectedItems())
+            {
+                if (item->type() == DiagramItem::Type)
+                    dragItems.append((DiagramItem*)item);
+                else if (item->type() == DiagramItemGroup::Type)
+                    dragItems += ((DiagramItemGroup*)item)->diagramItems();
+            }
+        }
+        if (grabber->type() == DiagramItem::Type && !dragItems.contains((DiagramItem*)grabber))
+            dragItems.append((DiagramItem*)grabber);
+    }
+    m_snapIndex.setDragItems(dragItems);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -878,6 +1257,7 @@ Document::Document(QGraphicsScene* scene) : QGraphicsView(scene)
 {
     m_undoStack = new QUndoStack(this);
     m_scene = (DiagramScene*)scene;
+    m_selection = new SelectionModel(m_scene);
     setDragMode(RubberBandDrag);
     setRubberBandSelectionMode(Qt::ContainsItemShape);
     m_stextEdit = NULL;
@@ -885,80 +1265,107 @@ Document::Document(QGraphicsScene* scene) : QGraphicsView(scene)
     m_editingItem = NULL;
 }
 
+Document::~Document()
+{
+    delete m_selection;
+}
+
 QUndoStack *Document::undoStack() const
 {
     return m_undoStack;
 }
 
-bool Document::load(QFile & file)
+// builds each item as soon as its record is read
+class ItemSink : public RecordSink
 {
-    QDomDocument doc;
-    doc.setContent(&file);
-
-    if (doc.documentElement().nodeName() == "controls")
+public:
+    ItemSink(QList<DiagramItem*>& items, QMap<int, QList<ResizableItem*> > & groupMap)
+        : m_items(items), m_groupMap(groupMap) {}
+    virtual bool addRecord(const ControlRecord& record)
     {
-        QMap<int, QList<ResizableItem*> > groups;
-        for(int i=0; i<(int)doc.documentElement().childNodes().length(); i++)
-        {
-            QDomNode nd = doc.documentElement().childNodes().at(i);
-            if (nd.nodeType() != QDomNode::ElementNode)
-                continue;
-            QDomElement* e = (QDomElement*) &nd;
-            DiagramItem* newItem = ItemDataBase::sload(*e);
-            m_scene->addItemOnTop(newItem);
-            bool ok = false;
-            int group;
-            group = e->attribute("isInGroup", "-1").toInt(&ok); 
-            if (ok && group >= 0)
-            {
-                groups[group].append(newItem);
-            }
-        }
-        foreach (int group, groups.keys())
-        {
-            scene()->createItemGroup(groups[group]);
-        }
+        DiagramItem* newItem = ItemDataBase::sload(record);
+        if (newItem == NULL)
+            return true;
+        if (record.groupId >= 0)
+            m_groupMap[record.groupId].append(newItem);
+        m_items.append(newItem);
         return true;
     }
-    else
-        return false;
+
+private:
+    QList<DiagramItem*>& m_items;
+    QMap<int, QList<ResizableItem*> > & m_groupMap;
+};
+
+bool Document::readItems(QXmlStreamReader& xml, QList<DiagramItem*>& items, 
+    QMap<int, QList<ResizableItem*> > & groupMap)
+{
+    ItemSink sink(items, groupMap);
+    return ItemDataBase::readRecords(xml, sink);
 }
 
-void Document::save(QTextStream & textStream)
+bool Document::load(QFile & file)
 {
-    const int Indent = 4;
-    QDomDocument doc;
-    QDomElement ctrls = doc.createElement("controls");
-    foreach (DiagramItem* item, scene()->sortedDiagramItems())
-    {
-        QDomElement ctrl = doc.createElement("control");
-        if (!item->itemData()->save(doc, ctrl))
-            return;
-        ctrls.appendChild(ctrl);
-    }
-    doc.appendChild(ctrls);
+    DocumentLoader loader(scene());
+    return loader.load(file);
+}
 
-    QDomNode xmlNode = doc.createProcessingInstruction("xml",
-        "version=\"1.0\" encoding=\"UTF-8\"");
-    doc.insertBefore(xmlNode, ctrls);
-    doc.save(textStream, Indent);
+// the document is clean only once the whole stream reached the device
+bool Document::save(QTextStream & textStream)
+{
+    if (!writeXml(textStream))
+        return false;
     m_undoStack->setClean();
+    return true;
 }
 
-bool Document::saveImage(const QString &fileName, const char *fileFormat)
+// the document as xml, without touching the undo stack; used for
+// exporting a copy. false if the stream failed to write.
+bool Document::writeXml(QTextStream & textStream)
 {
-    QImage newImage((int)scene()->sceneRect().width(), (int)scene()->sceneRect().height(), 
-        QImage::Format_RGB32);
-    QPainter painter(&newImage);
+    // each item keeps its serialized <control> element until an edit or an
+    // undo command touches it, so saving an unchanged document only
+    // concatenates the cached fragments.
+    textStream.setCodec("UTF-8");
+    textStream << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<controls>\n";
+    foreach (DiagramItem* item, scene()->sortedDiagramItems())
+        textStream << item->itemData()->xmlFragment();
+    textStream << "</controls>\n";
+    textStream.flush();
+    return textStream.status() == QTextStream::Ok;
+}
 
-    scene()->render(&painter, scene()->sceneRect());
-    if (newImage.save(fileName,fileFormat,80))
+bool Document::saveBinary(QIODevice& device)
+{
+    QList<ControlRecord> records;
+    foreach (DiagramItem* item, scene()->sortedDiagramItems())
     {
-        qDebug()<<"SAVE SUCCESS!";
-        return true;
+        ControlRecord record;
+        item->itemData()->save(record);
+        records.append(record);
     }
-    else
+    if (!BinaryDocument::write(device, records))
         return false;
+    m_undoStack->setClean();
+    return true;
+}
+
+bool Document::saveVector(const QString &fileName)
+{
+    QString format = QFileInfo(fileName).suffix();
+    if (!VectorExporter::isVectorFormat(format))
+        return false;
+    VectorExporter exporter(fileName, format);
+    return exporter.addPage(scene()) && exporter.end();
+}
+
+bool Document::saveImage(const QString &fileName, const char *fileFormat, qreal scale)
+{
+    ImageExporter exporter(scene(), scale);
+    if (qstricmp(fileFormat, "PNG") == 0)
+        return exporter.writePng(fileName);
+    // other formats are encoded by Qt, from the whole image at once
+    return exporter.render().save(fileName, fileFormat, 80);
 }
 
 QString Document::fileName() const
@@ -989,28 +1396,9 @@ void Document::itemResized(ResizableItem *item, const QRectF &oldPos, const QRec
 QList<DiagramItem*> Document::createItemsByText(const QString& text, QMap<int, QList<ResizableItem*> > & groupMap)
 {
     QList<DiagramItem*> items;
-    QDomDocument doc;
     groupMap.clear();
-    if (doc.setContent(text))
-    {
-        if (doc.documentElement().nodeName() == "controls")
-        {
-            for(int i=0; i<(int)doc.documentElement().childNodes().length(); i++)
-            {
-                QDomNode nd = doc.documentElement().childNodes().at(i);
-                if (nd.nodeType() != QDomNode::ElementNode)
-                    continue;
-                QDomElement* e = (QDomElement*) &nd;
-                DiagramItem* newItem = ItemDataBase::sload(*e);
-                bool ok = false;
-                int group;
-                group = e->attribute("isInGroup", "-1").toInt(&ok); 
-                if (ok && group >= 0)
-                    groupMap[group].append(newItem);
-                items.append(newItem);
-            }
-        }
-    }
+    QXmlStreamReader xml(text);
+    readItems(xml, items, groupMap);
     return items;
 }
 
@@ -1155,7 +1543,7 @@ void Document::endEdit()
 #define SET_INT_PROP_IMPL(prop) \
     void Document::set##prop(int value) \
 { \
-    ResizableItem* ritem = scene()->selectedSortedItems()[0]; \
+    ResizableItem* ritem = m_selection->first(); \
     Q_ASSERT(ritem->type() == DiagramItem::Type); \
     DiagramItem* ditem = (DiagramItem*) ritem; \
     undoStack()->push(new ChangeIntPropertyCommand(ditem, value, P_##prop)); \
@@ -1164,28 +1552,28 @@ void Document::endEdit()
 #define SET_BOOL_PROP_IMPL(prop) \
 void Document::set##prop(bool value) \
 { \
-    ResizableItem* ritem = scene()->selectedSortedItems()[0]; \
+    ResizableItem* ritem = m_selection->first(); \
     Q_ASSERT(ritem->type() == DiagramItem::Type); \
     DiagramItem* ditem = (DiagramItem*) ritem; \
     undoStack()->push(new ChangeBoolPropertyCommand(ditem, value, P_##prop)); \
 }
 void Document::autoResize()
 {
-    ResizableItem* ritem = scene()->selectedSortedItems()[0];
+    ResizableItem* ritem = m_selection->first();
     Q_ASSERT(ritem->type() == DiagramItem::Type);
     DiagramItem* ditem = (DiagramItem*) ritem;
     undoStack()->push(new AutosizeCommand(ditem));
 }
 void Document::setFontSize(const QString & snumber)
 {
-    ResizableItem* ritem = scene()->selectedSortedItems()[0];
+    ResizableItem* ritem = m_selection->first();
     Q_ASSERT(ritem->type() == DiagramItem::Type);
     DiagramItem* ditem = (DiagramItem*) ritem;
     undoStack()->push(new ChangeIntPropertyCommand(ditem, snumber.toInt(), P_FontSize));
 }
 void Document::setColor()
 {
-    ResizableItem* ritem = scene()->selectedSortedItems()[0];
+    ResizableItem* ritem = m_selection->first();
     Q_ASSERT(ritem->type() == DiagramItem::Type);
     DiagramItem* ditem = (DiagramItem*) ritem;
     QColor color = QColorDialog::getColor(ditem->itemData()->color(), this);
@@ -12,9 +12,16 @@
 #include <QListView>
 #include <QFile>
 #include <QMap>
+#include <QHash>
+#include <QCache>
+#include "snapindex.hxx"
+#include "selectionmodel.hxx"
 
 QT_FORWARD_DECLARE_CLASS(QUndoStack)
 QT_FORWARD_DECLARE_CLASS(QTextStream)
+QT_FORWARD_DECLARE_CLASS(QXmlStreamReader)
+
+struct ControlRecord;
 
 enum DiagramKey
 {
@@ -149,32 +156,42 @@ private:
 
 ///////////////////////////////////////////////////////////////////////////////
 
-class Grip : public QGraphicsRectItem
+class ResizableItem;
+
+// draws the resize handles of every selected item and hit-tests them. it
+// is one item on top of the scene, instead of eight child items per
+// selected item; it takes no mouse or hover events itself, the items do
+// and ask it which handle is under the cursor.
+class SelectionOverlay : public QGraphicsItem
 {
 public:
     enum {Type = UserType + 1};
     virtual int type() const {return Type;}
 
-    enum PosType {NorthMiddle, NorthEast, EastMiddle, SouthEast, 
-        SouthMiddle, SouthWest, WestMiddle, NorthWest};
-    void setPosType(PosType posType){m_posType = posType;}
-    PosType posType(){return m_posType;}
+    enum Handle {NoHandle = -1, NorthMiddle, NorthEast, EastMiddle, SouthEast, 
+        SouthMiddle, SouthWest, WestMiddle, NorthWest, HandleLast};
+
+    SelectionOverlay();
+
+    static QRectF handleRect(Handle handle, const QSizeF& size);
+    static bool hasHandle(ResizableItem* item, Handle handle);
+    static Qt::CursorShape handleCursor(Handle handle);
+    Handle handleAt(ResizableItem* item, const QPointF& scenePos);
+    void invalidate();
+
+    virtual QRectF boundingRect() const;
+    virtual void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget);
 
-    Grip(qreal len, PosType pos, QGraphicsItem *parent);
-    ~Grip();
-    void setPos();
-protected:
-    virtual void hoverEnterEvent (QGraphicsSceneHoverEvent * event);
-    virtual void hoverLeaveEvent (QGraphicsSceneHoverEvent * event);
 private:
-    PosType m_posType;
-    qreal m_size;
+    void refresh() const;
+
+    mutable bool m_dirty;
+    mutable QRectF m_boundingRect;
+    mutable QVector<QRectF> m_handles;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
-class ResizableItem;
-
 class ResizableItemHelper
 {
 public:
@@ -183,6 +200,7 @@ public:
     ResizableItemHelper(ResizableItem* item);
     QSizeF size() {return m_size;}
     void setSize(QSizeF s) {m_size = s;}
+    MouseMode mouseMode() {return m_mouseMode;}
 
     QRectF boundingRect() const;
     QPainterPath shape() const;
@@ -191,16 +209,13 @@ public:
     bool mousePressEvent(QGraphicsSceneMouseEvent *event);
     bool mouseMoveEvent(QGraphicsSceneMouseEvent *event);
     bool mouseReleaseEvent(QGraphicsSceneMouseEvent *event);
-    void showGrips(bool visible);
-private:
-    void createGrips();
+    void hoverMoveEvent(QGraphicsSceneHoverEvent *event);
 private:
     ResizableItem* m_item;
     QSizeF m_size;
     MouseMode m_mouseMode;
     QGraphicsRectItem *m_rubberBandRect;
-    QList<Grip*> m_grips;
-    Grip * m_curGrip;
+    SelectionOverlay::Handle m_curHandle;
     QPointF m_lastPoint;
     QPointF m_lastPos;
 };
@@ -215,10 +230,11 @@ public:
     static bool isResizableItem(QGraphicsItem* item) { return item->type() >= ResizableItem::Type;}
 
     ResizableItem(QGraphicsItem *parent = 0) : QGraphicsItem(parent) {}
+    ~ResizableItem();
 
     ResizableItemHelper* resizeHelper() {return m_helper;}
     QSizeF size() {return m_helper->size();}
-    void setSize(QSizeF s) {m_helper->setSize(s);}
+    void setSize(QSizeF s);
     QRectF posRect() { return QRectF(pos(), size()); }
     void setPosRect(QRectF rc) {setPos(rc.topLeft()); setSize(rc.size());}
     bool locked();
@@ -227,6 +243,9 @@ public:
 
     virtual void setPosRectAndNotify(QRectF rc) {setPosRect(rc);}
     virtual void subPaint(QPainter *, const QStyleOptionGraphicsItem *) {};
+    // drop the cached xml of this item (and its children) after a change
+    // of position, z-order or lock state.
+    virtual void invalidateSavedXml() {}
 
     // forward all to helper class
     virtual QRectF boundingRect() const { return m_helper->boundingRect();}
@@ -237,6 +256,8 @@ public:
         m_helper->paint(painter, option, widget);
     }
 protected:
+    // keeps the scene's z-order index up to date
+    virtual QVariant itemChange(GraphicsItemChange change, const QVariant &value);
     virtual void mousePressEvent(QGraphicsSceneMouseEvent *event) 
     {
         if (!m_helper->mousePressEvent(event))
@@ -252,6 +273,11 @@ protected:
         if (!m_helper->mouseReleaseEvent(event))
             QGraphicsItem::mouseReleaseEvent(event);
     }
+    virtual void hoverMoveEvent(QGraphicsSceneHoverEvent *event)
+    {
+        m_helper->hoverMoveEvent(event);
+        QGraphicsItem::hoverMoveEvent(event);
+    }
 protected:
     ResizableItemHelper* m_helper;
 };
@@ -259,6 +285,7 @@ protected:
 ///////////////////////////////////////////////////////////////////////////////
 
 class ItemDataBase;
+class LayoutContext;
 class QLineEdit;
 class QTextEdit;
 
@@ -268,7 +295,9 @@ public:
     enum {Type = UserType + 3};
     virtual int type() const {return Type;}
 
-    DiagramItem(DiagramKey key, QPointF pos, QGraphicsItem *parent = 0);
+    DiagramItem(DiagramKey key, QPointF pos, QGraphicsItem *parent = 0, LayoutContext* context = NULL);
+    // a loaded item: see ItemDataBase::init(const ControlRecord&)
+    DiagramItem(const ControlRecord& record, LayoutContext* context = NULL);
     ~DiagramItem();
 
     DiagramKey key() {return m_key;}
@@ -279,9 +308,12 @@ public:
     void setSizeAndNotify(QSizeF sz);
     virtual void subPaint(QPainter *painter, const QStyleOptionGraphicsItem *option);
     virtual void setPosRectAndNotify(QRectF rc);
+    virtual void invalidateSavedXml();
     virtual void mouseDoubleClickEvent(QGraphicsSceneMouseEvent * event);
 
 private:
+    void createData(DiagramKey key, QPointF pos, LayoutContext* context);
+
     DiagramKey m_key;
     ItemDataBase* m_data;
     int m_id;
@@ -301,10 +333,45 @@ public:
     QList<DiagramItem*> diagramItems();
     void resizeChildren(const QRectF &oldPos);
     virtual void subPaint(QPainter *painter, const QStyleOptionGraphicsItem *option);
+    virtual void invalidateSavedXml();
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// orders the scene's top-level items by z-value; the item pointer breaks
+// ties so that items sharing a z-value still get distinct keys.
+struct ZOrderKey
+{
+    ZOrderKey(qreal _z = 0, ResizableItem* _item = NULL) : z(_z), item(_item) {}
+    bool operator<(const ZOrderKey& other) const
+    {
+        if (z != other.z)
+            return z < other.z;
+        return item < other.item;
+    }
+    qreal z;
+    ResizableItem* item;
+};
+
+// one background tile: its position in the tile grid of a zoom level,
+// and that level as device pixels per scene unit, in thousandths.
+struct BackgroundTileKey
+{
+    BackgroundTileKey(int _x, int _y, int _scale) : x(_x), y(_y), scale(_scale) {}
+    bool operator==(const BackgroundTileKey& other) const
+    {
+        return x == other.x && y == other.y && scale == other.scale;
+    }
+    int x;
+    int y;
+    int scale;
+};
+
+inline uint qHash(const BackgroundTileKey& key)
+{
+    return (uint)key.x ^ ((uint)key.y << 12) ^ ((uint)key.scale << 20);
+}
+
 class DiagramScene : public QGraphicsScene
 {
     Q_OBJECT
@@ -314,8 +381,10 @@ public:
     static void sort(QList<DiagramItem*> & items);
 
     DiagramScene(QObject *parent = 0);
+    ~DiagramScene();
     
     virtual void drawBackground(QPainter *painter, const QRectF &rect);
+    virtual void drawForeground(QPainter *painter, const QRectF &rect);
     virtual void mouseMoveEvent(QGraphicsSceneMouseEvent *event);
     virtual void mouseReleaseEvent(QGraphicsSceneMouseEvent *event);
     virtual void mousePressEvent(QGraphicsSceneMouseEvent *event);
@@ -326,26 +395,59 @@ public:
     void destroyItemGroup(DiagramItemGroup *group);
     DiagramItemGroup *createItemGroup(const QList<ResizableItem *> &items);
     QList<ResizableItem*> topLevelSortedItems();
+    int topLevelItemCount() const {return m_zOrder.count();}
     QList<ResizableItem*> selectedSortedItems();
     QList<DiagramItem*> sortedDiagramItems();
+    ResizableItem* itemAbove(ResizableItem* item);
+    ResizableItem* itemBelow(ResizableItem* item);
+    qreal topZValue();
+    qreal bottomZValue();
+
+    int selectionStamp() const {return m_selectionStamp;}
+    void setItemsSelected(const QList<ResizableItem*>& items, bool selected);
+    SelectionOverlay* selectionOverlay() {return m_overlay;}
+    void selectAllItems();
+
+    void reindexItem(ResizableItem* item);
+    void unindexItem(ResizableItem* item);
+    void updateSnapGeometry(ResizableItem* item);
+    bool matchSize(ResizableItem* item, qreal& w, qreal& h, bool matchW, bool matchH);
 
     void addItemOnTop(ResizableItem* item);
+    void addItemsOnTop(const QList<ResizableItem*>& items);
+    void addItems(const QList<ResizableItem*>& items);
 
     void raiseItemMoved(ResizableItem *item, const QPointF &oldPos, const QPointF &newPos);
     void raiseItemResized(ResizableItem *item, const QRectF &oldPos, const QRectF &newPos);
+    void raiseItemRemoved(ResizableItem *item);
     void raiseBeginEdit(DiagramItem* item);
 Q_SIGNALS:
     void itemMoved(ResizableItem *item, const QPointF &oldPos, const QPointF &newPos);
     void itemResized(ResizableItem *item, const QRectF &oldPos, const QRectF &newPos);
+    // the item is leaving the scene or being destroyed
+    void itemRemoved(ResizableItem *item);
     void beginEdit(DiagramItem* item);
     void endEdit();
 
+public Q_SLOTS:
+    void touchSelection() {m_selectionStamp++; if (m_overlay != NULL) m_overlay->invalidate();}
+
+private:
+    void insertItems(const QList<ResizableItem*>& items);
+    void drawGrid(QPainter *painter, const QRectF &rect);
+    void updateSnapGuides(const SnapResult& snap);
+
 private:
     bool m_showGrid;
     int m_nextId;
-    qreal m_snapOffset;
-    qreal m_snapLine;
-    bool m_snapHorz;
+    int m_selectionStamp;
+    SelectionOverlay* m_overlay;
+    QMap<ZOrderKey, ResizableItem*> m_zOrder;
+    QHash<ResizableItem*, qreal> m_indexedZ;
+    SnapIndex m_snapIndex;
+    SnapResult m_snap;
+    QCache<BackgroundTileKey, QPixmap> m_backgroundTiles;
+    QBrush m_tileBrush;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -358,6 +460,7 @@ protected:
     Document(QGraphicsScene* );
 
 public:
+    ~Document();
     static bool isValidItemsText(const QString& text);
     static QList<DiagramItem*> createItemsByText(const QString& text, QMap<int, QList<ResizableItem*> > & groupMap);
     static QString serializeItemsToText(QList<ResizableItem*> items);
@@ -365,14 +468,22 @@ public:
 public:
     static Document* createDocument(QObject* parent);
     bool load(QFile &stream);
-    void save(QTextStream &stream);
+    bool save(QTextStream &stream);
+    bool writeXml(QTextStream &stream);
+    bool saveBinary(QIODevice &device);
 
     QString fileName() const;
     void setFileName(const QString &fileName);
 
     QUndoStack *undoStack() const;
     DiagramScene* scene();
-    bool saveImage(const QString &fileName, const char *fileFormat);
+    SelectionModel* selection() {return m_selection;}
+    bool saveImage(const QString &fileName, const char *fileFormat, qreal scale = 1.0);
+    bool saveVector(const QString &fileName);
+
+private:
+    static bool readItems(QXmlStreamReader& xml, QList<DiagramItem*>& items, 
+        QMap<int, QList<ResizableItem*> > & groupMap);
 
 Q_SIGNALS:
     void deleteKeyPressed();
@@ -406,6 +517,7 @@ private:
     QString m_fileName;
     QUndoStack *m_undoStack;
     DiagramScene* m_scene;
+    SelectionModel* m_selection;
     QLineEdit* m_stextEdit;
     QTextEdit* m_mtextEdit;
     DiagramItem* m_editingItem;
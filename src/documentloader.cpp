@@ -0,0 +1,274 @@
+#include "documentloader.hxx"
+#include "binarydocument.hxx"
+#include "document.hxx"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QThread>
+#include <QThreadPool>
+#include <QXmlStreamReader>
+#include <QtConcurrent>
+
+#define LOAD_BATCH_SIZE                     256
+#define ATTACH_INTERVAL_MS                  16
+#define ATTACH_BUDGET_MS                    8
+
+///////////////////////////////////////////////////////////////////////////////
+
+// runs on a worker. the items are built outside of any scene and only
+// measure through the layout context, which is safe to share; their data
+// objects are handed over to the gui thread, which owns them from now on.
+ItemBatch buildItems(QList<ControlRecord> records, qint64 endOffset, LayoutContext* context)
+{
+    ItemBatch batch;
+    batch.endOffset = endOffset;
+    QThread* guiThread = QCoreApplication::instance()->thread();
+    foreach (const ControlRecord& record, records)
+    {
+        DiagramItem* item = ItemDataBase::sload(record, context);
+        if (item == NULL)
+            continue;
+        item->itemData()->moveToThread(guiThread);
+        batch.items.append(item);
+        batch.groupIds.append(record.groupId);
+    }
+    return batch;
+}
+
+DocumentLoader::DocumentLoader(DiagramScene* scene, LayoutContext* context, QThreadPool* pool,
+    QObject* parent) : QObject(parent), m_cancelled(0), m_fileSize(0), m_readFile(NULL),
+    m_restoreIndex(false)
+{
+    // the default context is set up here, on the gui thread, not by the
+    // first worker that needs it
+    if (context == NULL)
+        context = LayoutContext::defaultContext();
+    if (pool == NULL)
+        pool = QThreadPool::globalInstance();
+    m_scene = scene;
+    m_context = context;
+    m_pool = pool;
+    m_attachTimer.setInterval(ATTACH_INTERVAL_MS);
+    connect(&m_attachTimer, SIGNAL(timeout()), this, SLOT(attachReady()));
+    connect(m_scene, SIGNAL(itemRemoved(ResizableItem*)), this, SLOT(forgetItem(ResizableItem*)));
+}
+
+DocumentLoader::~DocumentLoader()
+{
+    m_cancelled.store(1);
+    m_reader.waitForFinished();
+    discardBatches();
+    restoreIndex();
+}
+
+bool DocumentLoader::load(QFile& file)
+{
+    if (!readRecords(file))
+    {
+        discardBatches();
+        return false;
+    }
+
+    // one insert for the whole file, so the scene index is rebuilt once
+    QList<ResizableItem*> items;
+    foreach (QFuture<ItemBatch> future, m_batches)
+    {
+        ItemBatch batch = future.result();
+        foreach (DiagramItem* item, batch.items)
+            items.append(item);
+        addToGroups(batch);
+    }
+    m_batches.clear();
+    m_scene->addItemsOnTop(items);
+    createGroups();
+    return true;
+}
+
+void DocumentLoader::start(const QString& fileName)
+{
+    m_fileSize = QFileInfo(fileName).size();
+    // every batch is a bulk insert; rather than have each one switch the
+    // bsp index off and rebuild it, it stays off for the whole load
+    if (m_scene->itemIndexMethod() == QGraphicsScene::BspTreeIndex)
+    {
+        m_scene->setItemIndexMethod(QGraphicsScene::NoIndex);
+        m_restoreIndex = true;
+    }
+    m_reader = QtConcurrent::run(m_pool, this, &DocumentLoader::readFile, fileName);
+    m_attachTimer.start();
+}
+
+bool DocumentLoader::isCancelled() const
+{
+    return m_cancelled.load() != 0;
+}
+
+void DocumentLoader::cancel()
+{
+    if (!m_attachTimer.isActive())
+        return;
+    m_cancelled.store(1);
+    m_attachTimer.stop();
+    m_reader.waitForFinished();
+    discardBatches();
+    restoreIndex();
+    emit finished(false);
+}
+
+// adds the batches that are built, in file order, for at most a part of
+// a frame, and finishes once the reader is done and nothing is left.
+void DocumentLoader::attachReady()
+{
+    QElapsedTimer clock;
+    clock.start();
+    while (clock.elapsed() < ATTACH_BUDGET_MS)
+    {
+        QFuture<ItemBatch> next;
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_batches.isEmpty() || !m_batches.first().isFinished())
+                break;
+            next = m_batches.takeFirst();
+        }
+        attach(next.result());
+    }
+
+    if (!m_reader.isFinished())
+        return;
+    bool ok = m_reader.result();
+    if (ok)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_batches.isEmpty())
+            return;
+    }
+    m_attachTimer.stop();
+    discardBatches();
+    if (ok)
+        createGroups();
+    restoreIndex();
+    emit finished(ok);
+}
+
+void DocumentLoader::attach(const ItemBatch& batch)
+{
+    QList<ResizableItem*> items;
+    foreach (DiagramItem* item, batch.items)
+        items.append(item);
+    m_scene->addItemsOnTop(items);
+    addToGroups(batch);
+    if (m_fileSize > 0)
+        emit progressChanged((int)(batch.endOffset * 100 / m_fileSize));
+}
+
+void DocumentLoader::addToGroups(const ItemBatch& batch)
+{
+    for (int i=0; i<batch.items.length(); i++)
+    {
+        if (batch.groupIds[i] >= 0)
+        {
+            m_groups[batch.groupIds[i]].append(batch.items[i]);
+            m_groupOf.insert(batch.items[i], batch.groupIds[i]);
+        }
+    }
+}
+
+// members deleted while the file is still loading are left out of their
+// group
+void DocumentLoader::forgetItem(ResizableItem* item)
+{
+    QHash<ResizableItem*, int>::iterator it = m_groupOf.find(item);
+    if (it == m_groupOf.end())
+        return;
+    m_groups[it.value()].removeOne(item);
+    m_groupOf.erase(it);
+}
+
+// a group spans batches, so groups are only made once every item is in
+void DocumentLoader::createGroups()
+{
+    QMap<int, QList<ResizableItem*> > groups = m_groups;
+    m_groups.clear();
+    m_groupOf.clear();
+    foreach (const QList<ResizableItem*>& items, groups)
+    {
+        if (!items.isEmpty())
+            m_scene->createItemGroup(items);
+    }
+}
+
+// runs on the pool for start()
+bool DocumentLoader::readFile(QString fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    return readRecords(file);
+}
+
+// decodes the file while the batches read so far are already being built
+bool DocumentLoader::readRecords(QFile& file)
+{
+    if (BinaryDocument::isBinary(file))
+    {
+        QList<ControlRecord> records;
+        if (!BinaryDocument::read(file, records))
+            return false;
+        qint64 size = file.size();
+        int count = records.length();
+        for (int i=0; i<count && !isCancelled(); i += LOAD_BATCH_SIZE)
+            submit(records.mid(i, LOAD_BATCH_SIZE), size * qMin(i + LOAD_BATCH_SIZE, count) / count);
+        return !isCancelled();
+    }
+
+    QXmlStreamReader xml(&file);
+    m_readFile = &file;
+    bool ok = ItemDataBase::readRecords(xml, *this);
+    if (ok && !m_records.isEmpty())
+        submit(m_records, file.size());
+    m_records.clear();
+    m_readFile = NULL;
+    return ok;
+}
+
+// hands the records out in batches as the xml is read
+bool DocumentLoader::addRecord(const ControlRecord& record)
+{
+    m_records.append(record);
+    if (m_records.length() < LOAD_BATCH_SIZE)
+        return true;
+    if (isCancelled())
+        return false;
+    submit(m_records, m_readFile->pos());
+    m_records.clear();
+    return true;
+}
+
+void DocumentLoader::submit(const QList<ControlRecord>& records, qint64 endOffset)
+{
+    QFuture<ItemBatch> future = QtConcurrent::run(m_pool, buildItems, records, endOffset, m_context);
+    QMutexLocker locker(&m_mutex);
+    m_batches.append(future);
+}
+
+void DocumentLoader::restoreIndex()
+{
+    if (!m_restoreIndex)
+        return;
+    m_restoreIndex = false;
+    m_scene->setItemIndexMethod(QGraphicsScene::BspTreeIndex);
+}
+
+// waits for the batches still out and deletes their items
+void DocumentLoader::discardBatches()
+{
+    QList<QFuture<ItemBatch> > batches;
+    {
+        QMutexLocker locker(&m_mutex);
+        batches.swap(m_batches);
+    }
+    foreach (QFuture<ItemBatch> future, batches)
+        qDeleteAll(future.result().items);
+}
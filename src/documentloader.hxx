@@ -0,0 +1,96 @@
+#ifndef DOCUMENTLOADER_H
+#define DOCUMENTLOADER_H
+
+#include <QAtomicInt>
+#include <QFuture>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QObject>
+#include <QTimer>
+#include "itemdata.hxx"
+
+class DiagramScene;
+class DiagramItem;
+class ResizableItem;
+class LayoutContext;
+class QFile;
+class QThreadPool;
+
+// the items built from one run of records, in file order
+struct ItemBatch
+{
+    QList<DiagramItem*> items;
+    QList<int> groupIds; // parallel to items
+    qint64 endOffset; // where the batch ends in the file, for progress
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// loads a saved document in three stages. the reader decodes control
+// records in file order and hands them out in batches; workers on a
+// thread pool turn each batch into measured, laid-out items that are not
+// in any scene yet; the gui thread then only adds the finished items to
+// the scene and rebuilds the groups.
+class DocumentLoader : public QObject, private RecordSink
+{
+    Q_OBJECT
+
+public:
+    DocumentLoader(DiagramScene* scene, LayoutContext* context = NULL, QThreadPool* pool = NULL,
+        QObject* parent = NULL);
+    ~DocumentLoader();
+
+    // blocks until every item is in the scene; on error nothing is added
+    bool load(QFile& file);
+    // reads the file on the pool too and adds the finished batches a frame
+    // at a time, so the scene stays usable while the rest is loading.
+    // finished() tells how it ended; after an error the items added so
+    // far stay in the scene.
+    void start(const QString& fileName);
+    bool isCancelled() const;
+
+public Q_SLOTS:
+    // stops reading and building and emits finished(false)
+    void cancel();
+
+Q_SIGNALS:
+    void progressChanged(int percent);
+    void finished(bool ok);
+
+private Q_SLOTS:
+    void attachReady();
+    void forgetItem(ResizableItem* item);
+
+private:
+    bool readFile(QString fileName);
+    bool readRecords(QFile& file);
+    virtual bool addRecord(const ControlRecord& record);
+    void submit(const QList<ControlRecord>& records, qint64 endOffset);
+    void attach(const ItemBatch& batch);
+    void addToGroups(const ItemBatch& batch);
+    void createGroups();
+    void discardBatches();
+    void restoreIndex();
+
+    DiagramScene* m_scene;
+    LayoutContext* m_context;
+    QThreadPool* m_pool;
+    QMutex m_mutex; // guards m_batches while the reader runs on the pool
+    QList<QFuture<ItemBatch> > m_batches;
+    // the members of each group read so far; items leaving the scene are
+    // dropped at once, as they may be freed before the groups are made
+    QMap<int, QList<ResizableItem*> > m_groups;
+    QHash<ResizableItem*, int> m_groupOf;
+    QFuture<bool> m_reader;
+    QAtomicInt m_cancelled;
+    QTimer m_attachTimer;
+    qint64 m_fileSize;
+    // the xml file being read and the batch being filled, on the reader
+    QFile* m_readFile;
+    QList<ControlRecord> m_records;
+    bool m_restoreIndex; // the scene's bsp index is off until start() ends
+};
+
+#endif // DOCUMENTLOADER_H
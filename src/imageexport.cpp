@@ -0,0 +1,188 @@
+#include "imageexport.hxx"
+#include "document.hxx"
+#include "pngwriter.hxx"
+#include <QFile>
+#include <QPainter>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <qmath.h>
+
+#define EXPORT_TILE_WIDTH                   512
+#define EXPORT_BAND_HEIGHT                  256
+#define MAX_BAND_BYTES                      (32 * 1024 * 1024)
+
+///////////////////////////////////////////////////////////////////////////////
+
+QRectF exportItemBounds(DiagramItem* item)
+{
+    QPointF pos = item->scenePos();
+    return QRectF(item->itemData()->displayList().bounds()).translated(pos) | QRectF(pos, item->size());
+}
+
+ExportSnapshot::ExportSnapshot(DiagramScene* scene, qreal scale) : m_scale(scale)
+{
+    foreach (DiagramItem* ditem, scene->sortedDiagramItems())
+    {
+        if (!ditem->isVisible())
+            continue;
+        ItemDataBase* data = ditem->itemData();
+        Item item;
+        item.pos = ditem->scenePos();
+        item.list = data->displayList();
+        item.theme = data->context()->theme();
+        item.bounds = exportItemBounds(ditem);
+        for (int i=0; i<item.list.length(); i++)
+        {
+            if (!isStyleDrawType(item.list.at(i).type))
+                continue;
+            DetachedStyle style;
+            if (item.theme->detach(item.list.at(i), scale, style))
+                item.styles.insert(i, style);
+        }
+        m_bounds |= item.bounds;
+        m_items.append(item);
+    }
+    m_bounds = QRectF(m_bounds.toAlignedRect());
+}
+
+QSize ExportSnapshot::pixelSize() const
+{
+    if (m_bounds.isEmpty())
+        return QSize(1, 1);
+    return QSize(qCeil(m_bounds.width() * m_scale), qCeil(m_bounds.height() * m_scale));
+}
+
+void ExportSnapshot::paint(QPainter* painter, const QRect& pixelRect) const
+{
+    QRectF rect(m_bounds.topLeft() + QPointF(pixelRect.topLeft()) / m_scale, QSizeF(pixelRect.size()) / m_scale);
+    painter->scale(m_scale, m_scale);
+    painter->translate(-rect.topLeft());
+    for (int i=0; i<m_items.size(); i++)
+    {
+        const Item& item = m_items.at(i);
+        if (!item.bounds.intersects(rect))
+            continue;
+        QRectF local = rect.translated(-item.pos);
+        painter->save();
+        painter->translate(item.pos);
+        for (int j=0; j<item.list.length(); j++)
+        {
+            if (!local.intersects(item.list.opBounds(j)))
+                continue;
+            const DrawOp& op = item.list.at(j);
+            if (isStyleDrawType(op.type))
+            {
+                QHash<int, DetachedStyle>::const_iterator it = item.styles.constFind(j);
+                if (it != item.styles.constEnd())
+                    StyleCache::drawDetached(painter, op.rc, it.value());
+            }
+            else
+                item.theme->paint(item.list, op, painter, NULL, false);
+        }
+        painter->restore();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// renders one tile straight into its columns of the band
+void renderTile(const ExportSnapshot* snapshot, uchar* bits, int bytesPerLine, QRect tile)
+{
+    QImage image(bits, tile.width(), tile.height(), bytesPerLine, QImage::Format_RGB32);
+    image.fill(Qt::white);
+    QPainter painter(&image);
+    painter.setRenderHints(QPainter::Antialiasing | QPainter::TextAntialiasing | QPainter::SmoothPixmapTransform);
+    snapshot->paint(&painter, tile);
+}
+
+void waitForTiles(QList<QFuture<void> >& tiles)
+{
+    for (int i=0; i<tiles.length(); i++)
+        tiles[i].waitForFinished();
+    tiles.clear();
+}
+
+ImageExporter::ImageExporter(DiagramScene* scene, qreal scale, QThreadPool* pool)
+    : m_snapshot(scene, scale), m_pool(pool)
+{
+    if (m_pool == NULL)
+        m_pool = QThreadPool::globalInstance();
+}
+
+// image holds the output rows from top on
+QList<QFuture<void> > ImageExporter::startTiles(QImage& image, int top)
+{
+    QList<QFuture<void> > tiles;
+    uchar* bits = image.bits();
+    for (int x=0; x<image.width(); x += EXPORT_TILE_WIDTH)
+    {
+        QRect tile(x, top, qMin(EXPORT_TILE_WIDTH, image.width() - x), image.height());
+        if (m_pool == NULL)
+            renderTile(&m_snapshot, bits + x * 4, image.bytesPerLine(), tile);
+        else
+        {
+            tiles.append(QtConcurrent::run(m_pool, renderTile, &m_snapshot, bits + x * 4,
+                image.bytesPerLine(), tile));
+        }
+    }
+    return tiles;
+}
+
+QImage ImageExporter::render()
+{
+    QSize size = this->size();
+    QImage image(size, QImage::Format_RGB32);
+    if (image.isNull())
+        return image;
+    QList<QFuture<void> > tiles = startTiles(image, 0);
+    waitForTiles(tiles);
+    return image;
+}
+
+bool ImageExporter::writePng(const QString& fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    return writePng(file);
+}
+
+bool ImageExporter::writePng(QIODevice& device)
+{
+    QSize size = this->size();
+    PngWriter png(&device);
+    if (!png.begin(size.width(), size.height()))
+        return false;
+
+    // two bands: one encodes while the other renders
+    int bandHeight = qBound(1, MAX_BAND_BYTES / (size.width() * 4), EXPORT_BAND_HEIGHT);
+    QImage bands[2];
+    bands[0] = QImage(size.width(), qMin(bandHeight, size.height()), QImage::Format_RGB32);
+    if (bands[0].isNull())
+        return false;
+    QList<QFuture<void> > tiles = startTiles(bands[0], 0);
+    int current = 0;
+    for (int y = 0; y < size.height(); )
+    {
+        waitForTiles(tiles);
+        int next = y + bands[current].height();
+        if (next < size.height())
+        {
+            QImage& band = bands[1 - current];
+            int h = qMin(bandHeight, size.height() - next);
+            if (band.height() != h)
+                band = QImage(size.width(), h, QImage::Format_RGB32);
+            if (band.isNull())
+                return false;
+            tiles = startTiles(band, next);
+        }
+        if (!png.writeRows(bands[current]))
+        {
+            waitForTiles(tiles);
+            return false;
+        }
+        y = next;
+        current = 1 - current;
+    }
+    return png.end();
+}
@@ -0,0 +1,79 @@
+#ifndef IMAGEEXPORT_H
+#define IMAGEEXPORT_H
+
+#include <QFuture>
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QRectF>
+#include <QVector>
+#include "itemdata.hxx"
+
+class DiagramScene;
+class DiagramItem;
+class QIODevice;
+class QThreadPool;
+
+// the scene rect an item paints into, its display list included
+QRectF exportItemBounds(DiagramItem* item);
+
+///////////////////////////////////////////////////////////////////////////////
+
+// a paint-only copy of the items of a scene. it is built on the gui thread:
+// the display lists are copied (they share their data) and every style op
+// is rendered into images up front. after that paint() only reads it, so
+// any number of threads can replay it at once.
+class ExportSnapshot
+{
+public:
+    ExportSnapshot(DiagramScene* scene, qreal scale);
+
+    // the union of the items' bounds, in scene coordinates
+    const QRectF& bounds() const {return m_bounds;}
+    qreal scale() const {return m_scale;}
+    QSize pixelSize() const;
+    // paints the part of the output at pixelRect into a painter whose
+    // origin is the top left of that rect
+    void paint(QPainter* painter, const QRect& pixelRect) const;
+
+private:
+    struct Item
+    {
+        QPointF pos;
+        QRectF bounds;
+        DisplayList list;
+        QHash<int, DetachedStyle> styles; // by op index
+        ThemeInterface* theme;
+    };
+    QVector<Item> m_items;
+    QRectF m_bounds;
+    qreal m_scale;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// renders a scene cropped to its items. the output is split into row bands
+// of bounded size and each band into tiles that render in parallel; png
+// output streams band by band while the next one renders, so memory stays
+// at two bands whatever the canvas size or scale.
+class ImageExporter
+{
+public:
+    ImageExporter(DiagramScene* scene, qreal scale = 1.0, QThreadPool* pool = NULL);
+
+    QSize size() const {return m_snapshot.pixelSize();}
+    // NULL renders the tiles on the calling thread
+    void setThreadPool(QThreadPool* pool) {m_pool = pool;}
+    bool writePng(const QString& fileName);
+    bool writePng(QIODevice& device);
+    // the whole image in one piece, for formats that cannot be streamed
+    QImage render();
+
+private:
+    QList<QFuture<void> > startTiles(QImage& image, int top);
+
+    ExportSnapshot m_snapshot;
+    QThreadPool* m_pool;
+};
+
+#endif // IMAGEEXPORT_H
@@ -1,10 +1,13 @@
 #include "itemdata.hxx"
 #include <QtGui>
+#include <QtWidgets>
 #include <QtXml>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
 #include "document.hxx"
 #include "mainwindow.hxx"
+#include "textmetrics.hxx"
 
-#define MAX_WIDGET_WIDTH                    2000
 #define DEF_FONT_SIZE                       11
 #define DEF_FONT_NAME                       "Comic Sans MS"
 #define WIDGET_BKCLR                        QColor(255, 255, 255)
@@ -12,16 +15,23 @@
 #define SEL_ITEM_BKCLR                      QColor(129, 152, 193)
 #define LINK_TEXT_CLR                       QColor(48,119,178)
 #define SLIDER_MAX_VAL                      100
+#define MAX_CACHE_PIXMAP_EXTENT             1024
+#define ITEM_CACHE_BUDGET_KB                (64 * 1024)
+#define OP_BOUNDS_MARGIN                    2
+#define LOD_SIMPLIFIED                      0.6
+#define LOD_BOX                             0.25
+#define SIMPLIFIED_CLR                      QColor(160, 160, 160)
+#define GREEK_CLR                           QColor(190, 190, 190)
+#define GREEK_CHAR_WIDTH                    6
+#define GREEK_LINE_HEIGHT                   16
+#define GREEK_BAR_HEIGHT                    6
 
 ///////////////////////////////////////////////////////////////////////////////
 
 #define ADD_STR_PROPERTY(type, name, str) \
     if (getProperties() & (type)) \
     { \
-        QDomElement nd = doc.createElement(name); \
-        QDomText t = doc.createTextNode(str); \
-        nd.appendChild(t); \
-        props.appendChild(nd); \
+        record.properties.append(qMakePair(QString(name), QString(str))); \
     }
 
 #define ADD_PROPERTY(type, name, value) \
@@ -47,128 +57,427 @@
 
 ///////////////////////////////////////////////////////////////////////////////
 
-int textWidth(const QString& t, const QFont* font = NULL)
+LayoutContext* LayoutContext::defaultContext()
+{
+    static ThemeStyleSheet s_theme;
+    static LayoutContext s_context(&s_theme, TextMetrics::instance());
+    return &s_context;
+}
+
+LayoutContext::LayoutContext(ThemeInterface* theme, TextMetrics* metrics)
+{
+    m_theme = theme;
+    m_metrics = metrics;
+}
+
+QFont LayoutContext::resolveFont(bool bold, bool italic, bool underline, int pointSize) const
+{
+    QFont font = m_theme->font();
+    font.setBold(bold);
+    font.setItalic(italic);
+    font.setUnderline(underline);
+    if (pointSize > 0)
+        font.setPointSize(pointSize);
+    return font;
+}
+
+int LayoutContext::textWidth(const QString& t, const QFont* font) const
+{
+    if (font == NULL)
+        font = &(m_theme->font());
+    return m_metrics->width(*font, t);
+}
+
+int LayoutContext::textHeight(const QString& t, int w, const QFont* font) const
 {
     if (font == NULL)
-        font = & (MainWindow::instance()->currentTheme()->font());
-    QFontMetrics fm(*font, MainWindow::instance()->currentDocument()->viewport());
-    return fm.width(t);
+        font = &(m_theme->font());
+    return m_metrics->height(*font, t, w);
 }
 
-int textHeight(const QString& t, int w, const QFont* font = NULL)
+int LayoutContext::textHeight(const QFont* font) const
 {
     if (font == NULL)
-        font = & (MainWindow::instance()->currentTheme()->font());
-    QFontMetrics fm(*font, MainWindow::instance()->currentDocument()->viewport());
-    QRect rc = fm.boundingRect(0,0, w, MAX_WIDGET_WIDTH, 
-        Qt::AlignLeft | Qt::AlignTop | Qt::TextWrapAnywhere | Qt::TextWordWrap, t);
-    return rc.height();
+        font = &(m_theme->font());
+    return m_metrics->lineHeight(*font);
 }
 
-int textHeight(const QFont* font = NULL)
+QRect LayoutContext::textBounds(const QRect& rc, int flags, const QString& t, const QFont* font) const
 {
     if (font == NULL)
-        font = & (MainWindow::instance()->currentTheme()->font());
-    QFontMetrics fm(*font, MainWindow::instance()->currentDocument()->viewport());
-    return fm.height();
+        font = &(m_theme->font());
+    return m_metrics->boundingRect(*font, rc, flags, t);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
+void DisplayList::clear()
+{
+    m_ops.clear();
+    m_opBounds.clear();
+    m_bounds = QRect();
+    m_texts.clear();
+    m_fonts.clear();
+    m_images.clear();
+}
+
+DrawOp& DisplayList::append(DrawType type, const QRect& rc, const QRect& area)
+{
+    DrawOp op;
+    op.type = type;
+    op.clrType = WidgetBackground;
+    op.style = SampleFrame;
+    op.font = -1;
+    op.textFlags = 0;
+    op.text = -1;
+    op.value = 0;
+    op.userClr = 0;
+    op.rc = rc;
+    m_ops.append(op);
+    QRect bounds = (rc | area).adjusted(-OP_BOUNDS_MARGIN, -OP_BOUNDS_MARGIN, OP_BOUNDS_MARGIN, OP_BOUNDS_MARGIN);
+    m_opBounds.append(bounds);
+    m_bounds |= bounds;
+    return m_ops.last();
+}
+
+int DisplayList::internText(const QString& text)
+{
+    int index = m_texts.indexOf(text);
+    if (index >= 0)
+        return index;
+    m_texts.append(text);
+    return m_texts.length() - 1;
+}
+
+int DisplayList::internFont(const QFont& font)
+{
+    int index = m_fonts.indexOf(font);
+    if (index >= 0)
+        return index;
+    m_fonts.append(font);
+    return m_fonts.size() - 1;
+}
+
+int DisplayList::addImage(const QImage* image)
+{
+    int index = m_images.indexOf(image);
+    if (index >= 0)
+        return index;
+    m_images.append(image);
+    return m_images.size() - 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// indexed by DrawType
+const ThemeStyleSheet::PaintFunc ThemeStyleSheet::s_paintFuncs[DrawLast] = 
+{
+    &ThemeStyleSheet::paintBackground,
+    &ThemeStyleSheet::paintFrame,
+    &ThemeStyleSheet::paintLine,
+    &ThemeStyleSheet::paintText,
+    &ThemeStyleSheet::paintImage,
+    &ThemeStyleSheet::paintVScrollBar,
+    &ThemeStyleSheet::paintLinkText,
+};
+
 ThemeStyleSheet::ThemeStyleSheet()
 {
     m_font = QFont(DEF_FONT_NAME, DEF_FONT_SIZE);
+    m_linkFont = m_font;
+    m_linkFont.setUnderline(true);
+    m_textPen = QPen(Qt::black);
+    m_linkPen = QPen(LINK_TEXT_CLR);
+    m_sliderOption.state = QStyle::State_Active | QStyle::State_Enabled;
+    m_sliderOption.orientation = Qt::Vertical;
+    m_sliderOption.minimum = 0;
+    m_sliderOption.maximum = SLIDER_MAX_VAL;
 }
 
-void ThemeStyleSheet::paint(const Graphy& graphy, QPainter *painter, const QStyleOptionGraphicsItem *)
+void ThemeStyleSheet::paint(const DisplayList& list, const DrawOp& op, QPainter *painter, 
+    const QStyleOptionGraphicsItem *, bool selected)
 {
-    if (graphy.type == DrawFrame)
-    {
-        QStyleOptionFrameV2 option;
-        option.rect = graphy.rc;
-        QWidget* styleSheet = MainWindow::instance()->frameSample;
-        if (graphy.styleSheet != NULL)
-            styleSheet = graphy.styleSheet;
-        QApplication::style()->drawPrimitive(QStyle::PE_Frame, &option, painter, styleSheet);
-    }
-    else if (graphy.type == DrawBackground)
-    {
-        QStyleOptionFrameV2 option;
-        option.rect = graphy.rc;
-        QColor clr;
-        if (graphy.clrType == WidgetBackground)
-            clr = WIDGET_BKCLR;
-        else if (graphy.clrType == SelectedWidgetBackground)
-            clr = SEL_WIDGET_BKCLR;
-        else if (graphy.clrType == SelectedItemBackground)
-            clr = SEL_ITEM_BKCLR;
-        else if (graphy.clrType == UserColor)
-            clr = graphy.userClr;
-        painter->fillRect(option.rect, clr);
-    }
-    else if (graphy.type == DrawLinkText)
-    {
-        QPen pen(LINK_TEXT_CLR);
-        QFont font = m_font;
-        if (graphy.customFont != NULL)
-            font = (*graphy.customFont);
-        font.setUnderline(true);
-        painter->setFont(font);
-        painter->setPen(pen);
-        painter->drawText(graphy.rc, graphy.textFlags, graphy.text);
-    }
-    else if (graphy.type == DrawTxt)
+    Q_ASSERT(op.type < DrawLast);
+    (this->*s_paintFuncs[op.type])(list, op, painter, selected);
+}
+
+QWidget* ThemeStyleSheet::styleSample(int style)
+{
+    switch (style)
     {
-        QPen pen(Qt::black);
-        painter->setPen(pen);
+    case SampleButton:
+        return MainWindow::instance()->buttonSample;
+    case SampleBrowserWindow:
+        return MainWindow::instance()->frameBrowserWindow;
+    default:
+        return MainWindow::instance()->frameSample;
+    }
+}
 
-        if (graphy.customFont != NULL)
-            painter->setFont(*graphy.customFont);
-        else
-            painter->setFont(m_font);
-        painter->drawText(graphy.rc, graphy.textFlags, graphy.text);
+void ThemeStyleSheet::paintFrame(const DisplayList&, const DrawOp& op, QPainter *painter, bool)
+{
+    m_frameOption.rect = op.rc;
+    m_styleCache.drawFrame(painter, styleSample(op.style), m_frameOption);
+}
+
+void ThemeStyleSheet::paintBackground(const DisplayList&, const DrawOp& op, QPainter *painter, bool selected)
+{
+    switch (op.clrType)
+    {
+    case WidgetBackground:
+    case SelectedWidgetBackground:
+        painter->fillRect(op.rc, selected ? SEL_WIDGET_BKCLR : WIDGET_BKCLR);
+        break;
+    case SelectedItemBackground:
+        painter->fillRect(op.rc, SEL_ITEM_BKCLR);
+        break;
+    case UserColor:
+        painter->fillRect(op.rc, QColor::fromRgba(op.userClr));
+        break;
     }
-    else if (graphy.type == DrawLine)
+}
+
+void ThemeStyleSheet::paintLinkText(const DisplayList& list, const DrawOp& op, QPainter *painter, bool)
+{
+    painter->setFont(op.font >= 0 ? list.font(op.font) : m_linkFont);
+    painter->setPen(m_linkPen);
+    painter->drawText(op.rc, op.textFlags, list.text(op.text));
+}
+
+void ThemeStyleSheet::paintText(const DisplayList& list, const DrawOp& op, QPainter *painter, bool)
+{
+    painter->setPen(m_textPen);
+    painter->setFont(op.font >= 0 ? list.font(op.font) : m_font);
+    painter->drawText(op.rc, op.textFlags, list.text(op.text));
+}
+
+void ThemeStyleSheet::paintLine(const DisplayList&, const DrawOp& op, QPainter *painter, bool)
+{
+    m_frameOption.rect = op.rc;
+    m_styleCache.drawFrame(painter, MainWindow::instance()->lineSample, m_frameOption);
+}
+
+void ThemeStyleSheet::paintVScrollBar(const DisplayList&, const DrawOp& op, QPainter *painter, bool)
+{
+    m_sliderOption.rect = op.rc;
+    m_sliderOption.sliderValue = op.value;
+    m_sliderOption.sliderPosition = op.value;
+    m_styleCache.drawVScrollBar(painter, MainWindow::instance()->verticalScrollBarSample, m_sliderOption);
+}
+
+void ThemeStyleSheet::paintImage(const DisplayList& list, const DrawOp& op, QPainter *painter, bool)
+{
+    painter->drawImage(op.rc, *list.image(op.value));
+}
+
+bool ThemeStyleSheet::detach(const DrawOp& op, qreal scale, DetachedStyle& style)
+{
+    switch (op.type)
     {
-        QStyleOptionFrameV2 option;
-        option.rect = graphy.rc;
-        QApplication::style()->drawPrimitive(QStyle::PE_Frame, &option, painter, MainWindow::instance()->lineSample);
+    case DrawFrame:
+        m_frameOption.rect = op.rc;
+        return m_styleCache.detachFrame(styleSample(op.style), m_frameOption, scale, style);
+    case DrawLine:
+        m_frameOption.rect = op.rc;
+        return m_styleCache.detachFrame(MainWindow::instance()->lineSample, m_frameOption, scale, style);
+    case DrawVScrollBar:
+        m_sliderOption.rect = op.rc;
+        m_sliderOption.sliderValue = op.value;
+        m_sliderOption.sliderPosition = op.value;
+        return m_styleCache.detachVScrollBar(MainWindow::instance()->verticalScrollBarSample,
+            m_sliderOption, scale, style);
+    default:
+        return false;
     }
-    else if (graphy.type == DrawVScrollBar)
+}
+
+void ThemeStyleSheet::paintSimplified(const DisplayList& list, const DrawOp& op, QPainter *painter, bool selected)
+{
+    switch (op.type)
     {
-        QStyleOptionSlider opt;
-        opt.state = QStyle::State_Active | QStyle::State_Enabled;
-        opt.rect = graphy.rc;
-        opt.orientation = Qt::Vertical;
-        opt.sliderValue = graphy.value;
-        opt.sliderPosition = opt.sliderValue;
-        opt.minimum = 0;
-        opt.maximum = SLIDER_MAX_VAL;
-        QApplication::style()->drawComplexControl(QStyle::CC_ScrollBar, &opt, painter, 
-            MainWindow::instance()->verticalScrollBarSample);
-    }
-    else if (graphy.type == DrawImage)
+    case DrawBackground:
+        paintBackground(list, op, painter, selected);
+        break;
+    case DrawFrame:
+    case DrawLine:
+        painter->setPen(SIMPLIFIED_CLR);
+        painter->setBrush(Qt::NoBrush);
+        painter->drawRect(op.rc.adjusted(0, 0, -1, -1));
+        break;
+    case DrawTxt:
+    case DrawLinkText:
+        paintGreekedText(op, list.text(op.text), painter);
+        break;
+    case DrawImage:
+    case DrawVScrollBar:
+        painter->fillRect(op.rc, GREEK_CLR);
+        break;
+    }
+}
+
+// one bar per line of text, about as wide as the text, aligned like it
+void ThemeStyleSheet::paintGreekedText(const DrawOp& op, const QString& text, QPainter *painter)
+{
+    QStringList lines = text.split('\n');
+    int lineCount = qMax(1, qMin(lines.length(), op.rc.height() / GREEK_LINE_HEIGHT));
+    int y = op.rc.top() + (op.rc.height() - lineCount * GREEK_LINE_HEIGHT) / 2;
+    for (int i=0; i<lineCount; i++, y += GREEK_LINE_HEIGHT)
     {
-        painter->drawPixmap(graphy.rc, *graphy.pm);
+        int w = qMin(op.rc.width(), lines[i].trimmed().length() * GREEK_CHAR_WIDTH);
+        if (w <= 0)
+            continue;
+        int x = op.rc.left();
+        if (op.textFlags & Qt::AlignHCenter)
+            x += (op.rc.width() - w) / 2;
+        else if (op.textFlags & Qt::AlignRight)
+            x += op.rc.width() - w;
+        painter->fillRect(QRect(x, y + (GREEK_LINE_HEIGHT - GREEK_BAR_HEIGHT) / 2, w, GREEK_BAR_HEIGHT), GREEK_CLR);
     }
 }
 
+void ThemeStyleSheet::paintBox(const QRect& rc, QPainter *painter, bool selected)
+{
+    painter->fillRect(rc, selected ? SEL_WIDGET_BKCLR : WIDGET_BKCLR);
+    painter->setPen(SIMPLIFIED_CLR);
+    painter->setBrush(Qt::NoBrush);
+    painter->drawRect(rc.adjusted(0, 0, -1, -1));
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 QString ItemDataBase::s_emptyString;
 
+// the rendered items of all documents share one cache, bounded by the
+// pixel memory it holds. an item has at most one entry per detail level,
+// so zooming across a threshold and back does not repaint either one;
+// the least recently painted entries go first.
+struct ItemCacheKey
+{
+    ItemCacheKey(const ItemDataBase* o, int l) : owner(o), level(l) {}
+    bool operator==(const ItemCacheKey& o) const {return owner == o.owner && level == o.level;}
+    const ItemDataBase* owner;
+    int level;
+};
+
+inline uint qHash(const ItemCacheKey& key)
+{
+    return qHash((quintptr)key.owner) ^ (uint)key.level;
+}
+
+QCache<ItemCacheKey, CachedPixmap>& itemPixmapCache()
+{
+    static QCache<ItemCacheKey, CachedPixmap> s_cache(ITEM_CACHE_BUDGET_KB);
+    return s_cache;
+}
+
+ItemDataBase::~ItemDataBase()
+{
+    invalidateCache();
+}
+
+void ItemDataBase::invalidateCache()
+{
+    if (!m_cached)
+        return;
+    for (int i=0; i<DetailLast; i++)
+        itemPixmapCache().remove(ItemCacheKey(this, i));
+}
+
+DetailLevel ItemDataBase::detailLevel(qreal lod)
+{
+    if (lod >= LOD_SIMPLIFIED)
+        return DetailFull;
+    if (lod >= LOD_BOX)
+        return DetailSimplified;
+    return DetailBox;
+}
+
 void ItemDataBase::paint(QPainter *painter, const QStyleOptionGraphicsItem *option)
 {
     if (m_drawingSequence.length() == 0)
+    {
+        invalidateCache();
         calculateDrawingSequence();
-    foreach (Graphy graphy, m_drawingSequence)
+    }
+    ThemeInterface* theme = m_context->theme();
+    // set when the item uses extended style options; null means paint all
+    QRectF exposed = option != NULL ? option->exposedRect : QRectF();
+
+    // vector output (pdf, svg) must stay vector, never blit a raster cache into it.
+    // it also always gets full detail, whatever the scale of the export.
+    if (isVectorDevice(painter))
     {
-        if (graphy.type == DrawBackground &&
-            (graphy.clrType == WidgetBackground || graphy.clrType == SelectedWidgetBackground))
+        paintSequence(painter, option, theme, DetailFull, exposed);
+        return;
+    }
+
+    PixmapCacheKey key;
+    key.size = posRect().size();
+    key.selected = item()->isSelected();
+    key.theme = theme;
+    key.scale = QStyleOptionGraphicsItem::levelOfDetailFromTransform(painter->worldTransform());
+    key.dpr = painter->device()->devicePixelRatioF();
+    DetailLevel level = detailLevel(key.scale);
+    ItemCacheKey cacheKey(this, level);
+    CachedPixmap* cached = itemPixmapCache().object(cacheKey);
+    QPixmap cache;
+    if (cached != NULL && cached->key == key)
+        cache = cached->pixmap;
+    else
+    {
+        QSize pixelSize = (QSizeF(key.size) * key.scale * key.dpr).toSize();
+        if (pixelSize.isEmpty() || pixelSize.width() > MAX_CACHE_PIXMAP_EXTENT ||
+            pixelSize.height() > MAX_CACHE_PIXMAP_EXTENT)
         {
-            graphy.clrType = item()->isSelected() ? SelectedWidgetBackground : WidgetBackground;
+            // zoomed in this far only the exposed part is painted anyway
+            itemPixmapCache().remove(cacheKey);
+            paintSequence(painter, option, theme, level, exposed);
+            return;
         }
-        MainWindow::instance()->currentTheme()->paint(graphy, painter, option);
+        cache = QPixmap(pixelSize);
+        cache.setDevicePixelRatio(key.dpr);
+        cache.fill(Qt::transparent);
+        QPainter cachePainter(&cache);
+        cachePainter.setRenderHints(painter->renderHints());
+        cachePainter.scale(key.scale, key.scale);
+        paintSequence(&cachePainter, option, theme, level);
+        cachePainter.end();
+        int cost = qMax(1, pixelSize.width() * pixelSize.height() * 4 / 1024);
+        itemPixmapCache().insert(cacheKey, new CachedPixmap(key, cache), cost);
+        m_cached = true;
+    }
+
+    // blit only the exposed part of the cache
+    QRectF target(QPointF(0, 0), QSizeF(key.size));
+    if (!exposed.isNull())
+        target &= exposed;
+    if (target.isEmpty())
+        return;
+    qreal pixelScale = key.scale * key.dpr;
+    QRectF source(target.topLeft() * pixelScale, target.size() * pixelScale);
+    painter->drawPixmap(target, cache, source);
+}
+
+void ItemDataBase::paintSequence(QPainter *painter, const QStyleOptionGraphicsItem *option, ThemeInterface* theme,
+    DetailLevel level, const QRectF& exposed)
+{
+    bool selected = item()->isSelected();
+    if (level == DetailBox)
+    {
+        theme->paintBox(QRect(QPoint(0, 0), posRect().size()), painter, selected);
+        return;
+    }
+    // nothing to test when the whole list is exposed, which is the common
+    // case for small items and for cache fills
+    bool cull = !exposed.isNull() && !exposed.contains(m_drawingSequence.bounds());
+    for (int i=0; i<m_drawingSequence.length(); i++)
+    {
+        if (cull && !exposed.intersects(m_drawingSequence.opBounds(i)))
+            continue;
+        if (level == DetailSimplified)
+            theme->paintSimplified(m_drawingSequence, m_drawingSequence.at(i), painter, selected);
+        else
+            theme->paint(m_drawingSequence, m_drawingSequence.at(i), painter, option, selected);
     }
 }
 
@@ -189,54 +498,52 @@ void ItemDataBase::pTrimText()
     trimTexts(m_texts);
 }
 
-void ItemDataBase::addFrameGraphy(const QRect& rc)
+void ItemDataBase::addFrameGraphy(const QRect& rc, StyleSample style)
 {
-    Graphy t;
-    t.type = DrawFrame;
-    t.rc = rc;
-    m_drawingSequence.append(t);
+    DrawOp& t = m_drawingSequence.append(DrawFrame, rc);
+    t.style = style;
 }
-void ItemDataBase::addBackgroundGraphy(const QRect& rc, ColorType clrType)
+void ItemDataBase::addBackgroundGraphy(const QRect& rc, ColorType clrType, const QColor& userClr)
 {
-    Graphy t;
-    t.type = DrawBackground;
-    t.rc = rc;
+    DrawOp& t = m_drawingSequence.append(DrawBackground, rc);
     t.clrType = clrType;
-    m_drawingSequence.append(t);
-
+    t.userClr = userClr.rgba();
 }
 void ItemDataBase::addLineGraphy(const QRect& rc)
 {
-    Graphy t;
-    t.type = DrawLine;
-    t.rc = rc;
-    m_drawingSequence.append(t);
+    m_drawingSequence.append(DrawLine, rc);
+}
+void ItemDataBase::addTextGraphy(const QRect& rc, int textFlags, const QString& text, const QFont* font)
+{
+    DrawOp& t = m_drawingSequence.append(DrawTxt, rc, m_context->textBounds(rc, textFlags, text, font));
+    t.text = m_drawingSequence.internText(text);
+    t.textFlags = textFlags;
+    if (font != NULL)
+        t.font = m_drawingSequence.internFont(*font);
 }
-void ItemDataBase::addTextGraphy(const QRect& rc, int textFlags, const QString& text)
+void ItemDataBase::addLinkTextGraphy(const QRect& rc, int textFlags, const QString& text, const QFont* font)
 {
-    Graphy t;
-    t.type = DrawTxt;
-    t.rc = rc;
-    t.text = text;
+    // the underline does not change the extent of the text
+    DrawOp& t = m_drawingSequence.append(DrawLinkText, rc, m_context->textBounds(rc, textFlags, text, font));
+    t.text = m_drawingSequence.internText(text);
     t.textFlags = textFlags;
-    m_drawingSequence.append(t);
+    if (font != NULL)
+    {
+        QFont linkFont = *font;
+        linkFont.setUnderline(true);
+        t.font = m_drawingSequence.internFont(linkFont);
+    }
 }
 void ItemDataBase::addVScrollbarGraphy(const QRect& rc, int value)
 {
-    Graphy t;
-    t.type = DrawVScrollBar;
-    t.rc = rc;
+    DrawOp& t = m_drawingSequence.append(DrawVScrollBar, rc);
     t.value = value;
-    m_drawingSequence.append(t);
 }
 
-void ItemDataBase::addImageGraphy(const QRect& rc, QPixmap* pm)
+void ItemDataBase::addImageGraphy(const QRect& rc, const QImage* image)
 {
-    Graphy t;
-    t.type = DrawImage;
-    t.rc = rc;
-    t.pm = pm;
-    m_drawingSequence.append(t);
+    DrawOp& t = m_drawingSequence.append(DrawImage, rc);
+    t.value = m_drawingSequence.addImage(image);
 }
 
 DiagramItemGroup* ItemDataBase::group()
@@ -257,83 +564,130 @@ int ItemDataBase::groupId()
     return groupId;
 }
 
-bool ItemDataBase::load(const QDomElement& element)
+bool ItemDataBase::load(const ControlRecord& record)
+{
+    applyRecord(record);
+    update(true);
+    return true;
+}
+
+void ItemDataBase::applyRecord(const ControlRecord& record)
 {
     // do nothing with isInGroup, controlID, controlTypeID.
     QPointF pos = item()->pos();
     QSizeF size = item()->size();
-    bool ok = false;
-    int t;
-    t = element.attribute("x", "-2").toInt(&ok); if (ok && t >= 0) pos.setX(t);
-    t = element.attribute("y", "-2").toInt(&ok); if (ok && t >= 0) pos.setY(t);
-    t = element.attribute("w", "-2").toInt(&ok); if (ok && t >= 0) size.setWidth(t);
-    t = element.attribute("h", "-2").toInt(&ok); if (ok && t >= 0) size.setHeight(t);
+    if (record.x >= 0) pos.setX(record.x);
+    if (record.y >= 0) pos.setY(record.y);
+    if (record.w >= 0) size.setWidth(record.w);
+    if (record.h >= 0) size.setHeight(record.h);
     item()->setPos(pos);
     item()->setSize(size);
-    t = element.attribute("measuredW", "-2").toInt(&ok); if (ok && t >= 0) m_measuredSize.setWidth(t);
-    t = element.attribute("measuredH", "-2").toInt(&ok); if (ok && t >= 0) m_measuredSize.setHeight(t);
-    t = element.attribute("zOrder", QString("%1").arg(item()->zValue())).toDouble(&ok); if (ok) item()->setZValue(t);
-    t = element.attribute("locked", QString("%1").arg(item()->locked())).toInt(&ok); if (ok) item()->setLocked(t ? true : false);
-    if (element.childNodes().length() == 0)
-        return true;
-
-    QDomNode propsNd = element.childNodes().at(0);
-    if (propsNd.nodeType() != QDomNode::ElementNode)
-        return true;
-    QDomElement* props = (QDomElement*) &propsNd;
-    if (props->nodeName() != "controlProperties")
-        return true;
-
-    for(int i=0; i<(int)props->childNodes().length(); i++)
+    if (record.measuredW >= 0) m_measuredSize.setWidth(record.measuredW);
+    if (record.measuredH >= 0) m_measuredSize.setHeight(record.measuredH);
+    if (record.hasZOrder) item()->setZValue(record.zOrder);
+    if (record.locked >= 0) item()->setLocked(record.locked ? true : false);
+
+    for (int i=0; i<record.properties.length(); i++)
     {
-        QDomNode nd = props->childNodes().at(i);
-        if (nd.nodeType() != QDomNode::ElementNode)
-            continue;
-        QDomElement* prop = (QDomElement*) &nd;
-        if (prop->childNodes().length() > 0)
-        {
-            QDomNode nd2 = prop->childNodes().at(0);
-            if (nd2.nodeType() == QDomNode::TextNode)
-            {
-                QDomText* text = (QDomText*) &nd2;
-                QString sProp = nd.nodeName();
-                QString sValue = text->data();
-                if (getProperties() & P_SingleLineText) 
-                { 
-                    if (sProp == "text") 
-                    { 
-                        m_texts.clear();
-                        m_texts.append(sValue.trimmed());
-                    } 
-                }
-                setProperty(sProp, sValue);
-            }
+        const QString& sProp = record.properties[i].first;
+        const QString& sValue = record.properties[i].second;
+        if (getProperties() & P_SingleLineText) 
+        { 
+            if (sProp == "text") 
+            { 
+                m_texts.clear();
+                m_texts.append(sValue.trimmed());
+            } 
         }
+        setProperty(sProp, sValue);
     }
     if (getProperties() & P_SelectedIndex)
     {
         if (m_selectedIndex < 0 || m_selectedIndex >= m_texts.length())
             m_selectedIndex = 0;
     }
-    update(true);
-    return true;
 }
 
-DiagramItem* ItemDataBase::sload(const QDomElement& element)
+DiagramItem* ItemDataBase::sload(const ControlRecord& record, LayoutContext* context)
 {
     // do nothing with isInGroup, controlID.
-    bool ok = false;
-    int t;
-    t = element.attribute("controlTypeID", "-1").toInt(&ok); 
-    if (ok && t >= 0 && t < KeyLast)
+    if (record.key >= 0 && record.key < KeyLast)
     {
-        DiagramItem* item = new DiagramItem((DiagramKey)t, QPointF(0, 0));
-        item->itemData()->load(element);
-        return item;
+        return new DiagramItem(record, context);
     }
     return NULL;
 }
 
+int readIntAttribute(const QXmlStreamAttributes& attrs, const char* name, int defaultValue)
+{
+    bool ok = false;
+    int t = attrs.value(QLatin1String(name)).toInt(&ok);
+    return ok ? t : defaultValue;
+}
+
+// reads the <control> element the reader is positioned on, up to and
+// including its end element.
+bool ItemDataBase::readRecord(QXmlStreamReader& xml, ControlRecord& record)
+{
+    QXmlStreamAttributes attrs = xml.attributes();
+    record.id = readIntAttribute(attrs, "controlID", -1);
+    record.key = readIntAttribute(attrs, "controlTypeID", -1);
+    record.x = readIntAttribute(attrs, "x", -2);
+    record.y = readIntAttribute(attrs, "y", -2);
+    record.w = readIntAttribute(attrs, "w", -2);
+    record.h = readIntAttribute(attrs, "h", -2);
+    record.measuredW = readIntAttribute(attrs, "measuredW", -2);
+    record.measuredH = readIntAttribute(attrs, "measuredH", -2);
+    record.locked = readIntAttribute(attrs, "locked", -1);
+    record.groupId = readIntAttribute(attrs, "isInGroup", -1);
+    bool ok = false;
+    qreal z = attrs.value(QLatin1String("zOrder")).toDouble(&ok);
+    record.hasZOrder = ok;
+    if (ok)
+        record.zOrder = z;
+
+    bool propsRead = false;
+    while (xml.readNextStartElement())
+    {
+        if (propsRead || xml.name() != QLatin1String("controlProperties"))
+        {
+            xml.skipCurrentElement();
+            continue;
+        }
+        propsRead = true;
+        while (xml.readNextStartElement())
+        {
+            QString sProp = xml.name().toString();
+            QString sValue = xml.readElementText(QXmlStreamReader::SkipChildElements);
+            if (!sValue.isEmpty())
+                record.properties.append(qMakePair(sProp, sValue));
+        }
+    }
+    return !xml.hasError();
+}
+
+// reads every <control> of a <controls> document as it streams by and
+// hands it on right away, so no DOM of the whole file is ever kept.
+bool ItemDataBase::readRecords(QXmlStreamReader& xml, RecordSink& sink)
+{
+    if (!xml.readNextStartElement() || xml.name() != QLatin1String("controls"))
+        return false;
+    while (xml.readNextStartElement())
+    {
+        if (xml.name() != QLatin1String("control"))
+        {
+            xml.skipCurrentElement();
+            continue;
+        }
+        ControlRecord record;
+        if (!readRecord(xml, record))
+            break;
+        if (!sink.addRecord(record))
+            return false;
+    }
+    return !xml.hasError();
+}
+
 QString ItemDataBase::joinTexts(const QStringList & texts, const QString& seperator)
 {
     QString s;
@@ -347,7 +701,37 @@ QString ItemDataBase::joinTexts(const QStringList & texts, const QString& sepera
     return s;
 }
 
-bool ItemDataBase::save(QDomDocument& doc, QDomElement& element)
+// same as text.trimmed().split("%0A"), in one scan over the text.
+QStringList ItemDataBase::splitEscapedTexts(const QString& text)
+{
+    QStringList texts;
+    const QChar* p = text.constData();
+    int begin = 0;
+    int end = text.length();
+    while (begin < end && p[begin].isSpace())
+        begin++;
+    while (end > begin && p[end - 1].isSpace())
+        end--;
+
+    int start = begin;
+    int i = begin;
+    while (i < end)
+    {
+        if (p[i] == QLatin1Char('%') && i + 2 < end && 
+            p[i + 1] == QLatin1Char('0') && p[i + 2] == QLatin1Char('A'))
+        {
+            texts.append(text.mid(start, i - start));
+            i += 3;
+            start = i;
+        }
+        else
+            i++;
+    }
+    texts.append(text.mid(start, end - start));
+    return texts;
+}
+
+void ItemDataBase::save(ControlRecord& record)
 {
     int groupx(0), groupy(0);
     if (group() != NULL)
@@ -355,42 +739,82 @@ bool ItemDataBase::save(QDomDocument& doc, QDomElement& element)
         groupx = group()->pos().x();
         groupy = group()->pos().y();
     }
-    element.setAttribute("controlID", item()->id());
-    element.setAttribute("controlTypeID", item()->key());
-    element.setAttribute("x", groupx + (int)item()->pos().x());
-    element.setAttribute("y", groupy + (int)item()->pos().y());
-    element.setAttribute("w", (posRect().size() == m_measuredSize) ? -1 : posRect().width());
-    element.setAttribute("h", (posRect().size() == m_measuredSize) ? -1 : posRect().height());
-    element.setAttribute("measuredW", m_measuredSize.width());
-    element.setAttribute("measuredH", m_measuredSize.height());
-    element.setAttribute("zOrder", item()->zValue());
-    element.setAttribute("locked", item()->locked());
-    element.setAttribute("isInGroup", groupId());
-    QDomElement props = doc.createElement("controlProperties");
-    addPropertyToDomElement(doc, props);
-    element.appendChild(props);
-    return true;
+    bool measured = (posRect().size() == m_measuredSize);
+    record.id = item()->id();
+    record.key = item()->key();
+    record.x = groupx + (int)item()->pos().x();
+    record.y = groupy + (int)item()->pos().y();
+    record.w = measured ? -1 : (int)posRect().width();
+    record.h = measured ? -1 : (int)posRect().height();
+    record.measuredW = m_measuredSize.width();
+    record.measuredH = m_measuredSize.height();
+    record.zOrder = item()->zValue();
+    record.hasZOrder = true;
+    record.locked = item()->locked() ? 1 : 0;
+    record.groupId = groupId();
+    record.properties.clear();
+    saveProperties(record);
 }
 
-bool ItemDataBase::load(const QString& xml)
+void ItemDataBase::writeRecord(QXmlStreamWriter& xml, const ControlRecord& record)
 {
-    QDomDocument doc;
-    if (doc.setContent(xml))
-        if (doc.documentElement().nodeName() == "control")
-            return load(doc.documentElement());
-    return false;
+    xml.writeStartElement("control");
+    xml.writeAttribute("controlID", QString::number(record.id));
+    xml.writeAttribute("controlTypeID", QString::number(record.key));
+    xml.writeAttribute("x", QString::number(record.x));
+    xml.writeAttribute("y", QString::number(record.y));
+    xml.writeAttribute("w", QString::number(record.w));
+    xml.writeAttribute("h", QString::number(record.h));
+    xml.writeAttribute("measuredW", QString::number(record.measuredW));
+    xml.writeAttribute("measuredH", QString::number(record.measuredH));
+    if (record.hasZOrder)
+        xml.writeAttribute("zOrder", QString::number(record.zOrder, 'g', 12));
+    if (record.locked >= 0)
+        xml.writeAttribute("locked", QString::number(record.locked));
+    xml.writeAttribute("isInGroup", QString::number(record.groupId));
+    xml.writeStartElement("controlProperties");
+    for (int i=0; i<record.properties.length(); i++)
+        xml.writeTextElement(record.properties[i].first, record.properties[i].second);
+    xml.writeEndElement();
+    xml.writeEndElement();
 }
-bool ItemDataBase::save(QString& xml)
+
+void ItemDataBase::save(QXmlStreamWriter& xml)
 {
-    QDomDocument doc;
-    QDomElement rootElm = doc.createElement("control");
-    if(save(doc, rootElm))
+    ControlRecord record;
+    save(record);
+    writeRecord(xml, record);
+}
+
+// the serialized <control> element, kept until the item or its
+// placement changes. see invalidateXmlCache().
+const QString& ItemDataBase::xmlFragment()
+{
+    if (m_xmlCache.isEmpty())
     {
-        doc.appendChild(rootElm);
-        xml = doc.toString();
-        return true;
+        QXmlStreamWriter xml(&m_xmlCache);
+        xml.setAutoFormatting(true);
+        xml.setAutoFormattingIndent(4);
+        save(xml);
+        m_xmlCache += QLatin1Char('\n');
     }
-    return false;
+    return m_xmlCache;
+}
+
+bool ItemDataBase::load(const QString& xml)
+{
+    QXmlStreamReader reader(xml);
+    if (!reader.readNextStartElement() || reader.name() != QLatin1String("control"))
+        return false;
+    ControlRecord record;
+    if (!readRecord(reader, record))
+        return false;
+    return load(record);
+}
+bool ItemDataBase::save(QString& xml)
+{
+    xml = xmlFragment();
+    return true;
 }
 
 QRect ItemDataBase::posRect()
@@ -403,10 +827,26 @@ QRect ItemDataBase::posRect()
 void ItemDataBase::init()
 {
     setDefaultData();
-    update(true);
+    layout(true);
+}
+
+// the defaults only fill in what the record leaves out; the item is
+// measured and laid out once, with its saved values.
+void ItemDataBase::init(const ControlRecord& record)
+{
+    setDefaultData();
+    applyRecord(record);
+    layout(true);
 }
 
 void ItemDataBase::update(bool toMeasuredSize)
+{
+    layout(toMeasuredSize);
+    m_item->update();
+}
+
+// measures and rebuilds the drawing sequence without touching the scene.
+void ItemDataBase::layout(bool toMeasuredSize)
 {
     QSize oldMeasuredSize = m_measuredSize;
     parseData();
@@ -416,13 +856,16 @@ void ItemDataBase::update(bool toMeasuredSize)
     if (m_measuredSize.width() > oldMeasuredSize.width() ||
         m_measuredSize.height() > oldMeasuredSize.height())
         m_item->setSize(m_measuredSize);
+    invalidateCache();
+    invalidateXmlCache();
     calculateDrawingSequence();
-    m_item->update();
 }
 
 void ItemDataBase::autoResize()
 {
     m_item->setSize(m_measuredSize);
+    invalidateCache();
+    invalidateXmlCache();
     calculateDrawingSequence();
     m_item->scene()->update();
 }
@@ -431,7 +874,7 @@ void ItemDataBase::autoResize()
 
 void ItemDataBase::setProperty(const QString& sProp, const QString& sValue)
 {
-    SET_PROPERTY(P_MultilineTexts, "text", m_texts, sValue.trimmed().split("%0A"));
+    SET_PROPERTY(P_MultilineTexts, "text", m_texts, splitEscapedTexts(sValue));
     SET_PROPERTY_INT(P_SelectedIndex, "selectedIndex", m_selectedIndex, sValue);
     SET_PROPERTY_INT(P_VScrollBar, "verticalScrollBar", m_vScrollbar, sValue);
     SET_PROPERTY_INT(P_Value, "value", m_value, sValue);
@@ -444,7 +887,7 @@ void ItemDataBase::setProperty(const QString& sProp, const QString& sValue)
         m_color.setNamedColor(sValue);
 }
 
-void ItemDataBase::addPropertyToDomElement(QDomDocument& doc, QDomElement& props)
+void ItemDataBase::saveProperties(ControlRecord& record)
 {
     ADD_STR_PROPERTY(P_SingleLineText, "text", (m_texts[0]));
     ADD_STR_PROPERTY(P_MultilineTexts, "text", (joinTexts(m_texts, "%0A")));
@@ -485,7 +928,22 @@ void ImageItemData::calculateDrawingSequence()
 {
     m_drawingSequence.clear();
     QRect rc = posRect();
-    addImageGraphy(rc, &m_pixmap);
+    addImageGraphy(rc, &m_image);
+}
+
+// every item of a kind shows the same resource image, so each one is
+// decoded once and shared. the load workers call this too.
+QImage resourceImage(const QString& path)
+{
+    static QMutex s_mutex;
+    static QHash<QString, QImage> s_images;
+    QMutexLocker locker(&s_mutex);
+    QHash<QString, QImage>::const_iterator it = s_images.constFind(path);
+    if (it != s_images.constEnd())
+        return it.value();
+    QImage image(path);
+    s_images.insert(path, image);
+    return image;
 }
 
 void ImageItemData::setDefaultData()
@@ -519,8 +977,7 @@ void ImageItemData::setDefaultData()
     else
         m_sImage = ":/icons/diagramdemo.png";
 
-    m_image.load(m_sImage);
-    m_pixmap = QPixmap::fromImage(m_image, Qt::OrderedAlphaDither);
+    m_image = resourceImage(m_sImage);
     m_measuredSize.setWidth(m_image.width());
     m_measuredSize.setHeight(m_image.height());
 }
@@ -781,26 +1238,18 @@ void Breadcrumbs::calculateDrawingSequence()
         if (i < texts.length() - 1)
         {
             w = textWidth(s, &m_font);
-            Graphy t;
-            t.type = DrawLinkText;
-            t.rc = QRect(pt, QSize(w, h));
-            t.text = s;
-            t.textFlags = textFlags;
-            t.customFont = &m_font;
-            m_drawingSequence.append(t);
+            addLinkTextGraphy(QRect(pt, QSize(w, h)), textFlags, s, &m_font);
             pt.setX(pt.x() + w);
 
             s = " > ";
             w = textWidth(s, &m_font);
-            addTextGraphy(QRect(pt, QSize(w, h)), textFlags, s);
-            m_drawingSequence[m_drawingSequence.length() - 1].customFont = &m_font;
+            addTextGraphy(QRect(pt, QSize(w, h)), textFlags, s, &m_font);
             pt.setX(pt.x() + w);
         }
         else
         {
             w = textWidth(s, &m_font);
-            addTextGraphy(QRect(pt, QSize(w, h)), textFlags, s);
-            m_drawingSequence[m_drawingSequence.length() - 1].customFont = &m_font;
+            addTextGraphy(QRect(pt, QSize(w, h)), textFlags, s, &m_font);
             pt.setX(pt.x() + w);
         }
         i++;
@@ -822,10 +1271,7 @@ void Breadcrumbs::calculateMesuredSize()
 
 void Breadcrumbs::parseData()
 {
-    m_font = MainWindow::instance()->currentTheme()->font();
-    m_font.setBold(m_fontBold);
-    m_font.setItalic(m_fontItalic);
-    m_font.setPointSize(m_fontSize);
+    m_font = m_context->resolveFont(m_fontBold, m_fontItalic, false, m_fontSize);
 }
 
 
@@ -848,8 +1294,7 @@ void BrowserWindow::calculateDrawingSequence()
 {
     m_drawingSequence.clear();
     QRect rc = posRect();
-    addFrameGraphy(rc);
-    m_drawingSequence[m_drawingSequence.length() - 1].styleSheet = MainWindow::instance()->frameBrowserWindow;
+    addFrameGraphy(rc, SampleBrowserWindow);
 
     QPoint ptRow1(160, 6);
     QPoint ptRow2(160, 32);
@@ -899,18 +1344,15 @@ void Button::calculateDrawingSequence()
     m_drawingSequence.clear();
     QRect rc = posRect();
 
-    addFrameGraphy(rc);
-    m_drawingSequence[m_drawingSequence.length() - 1].styleSheet = MainWindow::instance()->buttonSample;
+    addFrameGraphy(rc, SampleButton);
 
     int t(2), r(5), b(4), l(2);
     QRect rc2 = rc;
     rc2.setTopLeft(rc.topLeft() + QPoint(l, t));
     rc2.setSize(rc.size() - QSize(l+r, t+b));
-    addBackgroundGraphy(rc2, UserColor);
-    m_drawingSequence[m_drawingSequence.length() - 1].userClr = m_color;
+    addBackgroundGraphy(rc2, UserColor, m_color);
 
-    addTextGraphy(rc, Qt::AlignCenter, text());
-    m_drawingSequence[m_drawingSequence.length() - 1].customFont = &m_font;
+    addTextGraphy(rc, Qt::AlignCenter, text(), &m_font);
 }
 void Button::calculateMesuredSize()
 {
@@ -924,9 +1366,5 @@ void Button::calculateMesuredSize()
 }
 void Button::parseData()
 {
-    m_font = MainWindow::instance()->currentTheme()->font();
-    m_font.setBold(m_fontBold);
-    m_font.setItalic(m_fontItalic);
-    m_font.setPointSize(m_fontSize);
-    m_font.setUnderline(m_fontUnderline);
+    m_font = m_context->resolveFont(m_fontBold, m_fontItalic, m_fontUnderline, m_fontSize);
 }
\ No newline at end of file
@@ -9,6 +9,12 @@
 #include <QImage>
 #include <QPixmap>
 #include <QFont>
+#include <QPen>
+#include <QVector>
+#include <QStringList>
+#include <QPair>
+#include <QStyleOption>
+#include "stylecache.hxx"
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -31,21 +37,76 @@ enum DrawType
     DrawImage, // rc
     DrawVScrollBar, // rc, value
     DrawLinkText, // rc, text
+    DrawLast,
 };
 
-struct Graphy
+// drawn through QStyle against the sample widgets, on the gui thread only
+inline bool isStyleDrawType(int type)
 {
-    Graphy() : pm(0), customFont(0), styleSheet(0) {}
-    DrawType type;
-    QRect rc;
-    ColorType clrType;
-    QString text;
+    return type == DrawFrame || type == DrawLine || type == DrawVScrollBar;
+}
+
+// how much of an item is drawn, picked from the view's level of detail
+enum DetailLevel
+{
+    DetailFull,
+    DetailSimplified, // frames as plain rects, text as greeked bars
+    DetailBox, // the item's outline only
+    DetailLast,
+};
+
+enum StyleSample
+{
+    SampleFrame,
+    SampleButton,
+    SampleBrowserWindow,
+};
+
+// one packed record of a display list. strings, fonts and images live in
+// side tables of the owning DisplayList and are referenced by index.
+struct DrawOp
+{
+    quint8 type;        // DrawType
+    quint8 clrType;     // ColorType
+    quint8 style;       // StyleSample
+    qint8 font;         // index into fonts, -1 for the theme font
     int textFlags;
-    QPixmap* pm;
-    int value;
-    QFont* customFont;
-    QWidget* styleSheet;
-    QColor userClr;
+    int text;           // index into texts, -1 for none
+    int value;          // scrollbar value, or index into images
+    QRgb userClr;
+    QRect rc;
+};
+Q_DECLARE_TYPEINFO(DrawOp, Q_MOVABLE_TYPE);
+
+class DisplayList
+{
+public:
+    void clear();
+    int length() const                     {return m_ops.size();}
+    const DrawOp& at(int i) const           {return m_ops.at(i);}
+    // area is what the op draws outside of rc, if anything (text that
+    // does not fit its rect)
+    DrawOp& append(DrawType type, const QRect& rc, const QRect& area = QRect());
+    // the area an op may touch (its rect and area plus what styles draw
+    // outside of them), and the union of all of them; used to skip ops
+    // outside the exposed rect.
+    const QRect& opBounds(int i) const      {return m_opBounds.at(i);}
+    const QRect& bounds() const             {return m_bounds;}
+
+    int internText(const QString& text);
+    int internFont(const QFont& font);
+    int addImage(const QImage* image);
+    const QString& text(int index) const    {return m_texts.at(index);}
+    const QFont& font(int index) const      {return m_fonts.at(index);}
+    const QImage* image(int index) const    {return m_images.at(index);}
+
+private:
+    QVector<DrawOp> m_ops;
+    QVector<QRect> m_opBounds;
+    QRect m_bounds;
+    QStringList m_texts;
+    QVector<QFont> m_fonts;
+    QVector<const QImage*> m_images;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -53,10 +114,17 @@ struct Graphy
 class QPainter;
 class QStyleOptionGraphicsItem;
 
+// paint() of the ops that are not style ops only reads the theme, so any
+// thread may call it. style ops are first rendered into images by detach(),
+// on the gui thread, and then drawn with StyleCache::drawDetached.
 class ThemeInterface
 {
 public:
-    virtual void paint(const Graphy& g, QPainter *p, const QStyleOptionGraphicsItem *opt) = 0;
+    virtual void paint(const DisplayList& list, const DrawOp& op, QPainter *p, 
+        const QStyleOptionGraphicsItem *opt, bool selected) = 0;
+    virtual bool detach(const DrawOp& op, qreal scale, DetachedStyle& style) = 0;
+    virtual void paintSimplified(const DisplayList& list, const DrawOp& op, QPainter *p, bool selected) = 0;
+    virtual void paintBox(const QRect& rc, QPainter *p, bool selected) = 0;
     virtual const QFont & font() = 0;
 
 };
@@ -65,17 +133,41 @@ class ThemeStyleSheet : public ThemeInterface
 {
 public:
     ThemeStyleSheet();
-    virtual void paint(const Graphy& g, QPainter *p, const QStyleOptionGraphicsItem *opt);
+    virtual void paint(const DisplayList& list, const DrawOp& op, QPainter *p, 
+        const QStyleOptionGraphicsItem *opt, bool selected);
+    virtual bool detach(const DrawOp& op, qreal scale, DetachedStyle& style);
+    virtual void paintSimplified(const DisplayList& list, const DrawOp& op, QPainter *p, bool selected);
+    virtual void paintBox(const QRect& rc, QPainter *p, bool selected);
     virtual const QFont & font() {return m_font;}
 private:
+    typedef void (ThemeStyleSheet::*PaintFunc)(const DisplayList& list, const DrawOp& op, 
+        QPainter *p, bool selected);
+    static const PaintFunc s_paintFuncs[DrawLast];
+
+    void paintBackground(const DisplayList& list, const DrawOp& op, QPainter *p, bool selected);
+    void paintFrame(const DisplayList& list, const DrawOp& op, QPainter *p, bool selected);
+    void paintLine(const DisplayList& list, const DrawOp& op, QPainter *p, bool selected);
+    void paintText(const DisplayList& list, const DrawOp& op, QPainter *p, bool selected);
+    void paintImage(const DisplayList& list, const DrawOp& op, QPainter *p, bool selected);
+    void paintVScrollBar(const DisplayList& list, const DrawOp& op, QPainter *p, bool selected);
+    void paintLinkText(const DisplayList& list, const DrawOp& op, QPainter *p, bool selected);
+    void paintGreekedText(const DrawOp& op, const QString& text, QPainter *p);
+    QWidget* styleSample(int style);
+
     QFont m_font;
+    QFont m_linkFont;
+    QPen m_textPen;
+    QPen m_linkPen;
+    QStyleOptionFrame m_frameOption;
+    QStyleOptionSlider m_sliderOption;
+    StyleCache m_styleCache;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
 class DiagramItem;
-class QDomElement;
-class QDomDocument;
+class QXmlStreamReader;
+class QXmlStreamWriter;
 class DiagramItemGroup;
 
 enum PropertyType
@@ -112,6 +204,90 @@ enum StateMode
     StateDisabled,
 };
 
+// one saved control, decoded but not yet turned into an item.
+// numeric fields keep -2 when the attribute was absent.
+struct ControlRecord
+{
+    ControlRecord() : id(-1), key(-1), x(-2), y(-2), w(-2), h(-2), measuredW(-2), measuredH(-2),
+        zOrder(0), hasZOrder(false), locked(-1), groupId(-1) {}
+    int id;
+    int key;
+    int x;
+    int y;
+    int w;
+    int h;
+    int measuredW;
+    int measuredH;
+    qreal zOrder;
+    bool hasZOrder;
+    int locked;
+    int groupId;
+    QList<QPair<QString, QString> > properties;
+};
+
+// takes the records of a <controls> document as they are read; returning
+// false stops the read.
+class RecordSink
+{
+public:
+    virtual ~RecordSink() {}
+    virtual bool addRecord(const ControlRecord& record) = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+class TextMetrics;
+
+// everything an item needs to measure and lay itself out: the theme (for
+// its base font) and a text measurement service. it does not touch
+// MainWindow, a document or a paint device, so layout can run on worker
+// threads and in a headless process.
+class LayoutContext
+{
+public:
+    static LayoutContext* defaultContext();
+
+    LayoutContext(ThemeInterface* theme, TextMetrics* metrics);
+    ThemeInterface* theme() const           {return m_theme;}
+    TextMetrics* metrics() const            {return m_metrics;}
+    const QFont& font() const               {return m_theme->font();}
+    QFont resolveFont(bool bold, bool italic, bool underline, int pointSize) const;
+
+    int textWidth(const QString& t, const QFont* font = NULL) const;
+    int textHeight(const QString& t, int w, const QFont* font = NULL) const;
+    int textHeight(const QFont* font = NULL) const;
+    QRect textBounds(const QRect& rc, int flags, const QString& t, const QFont* font = NULL) const;
+
+private:
+    ThemeInterface* m_theme;
+    TextMetrics* m_metrics;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct PixmapCacheKey
+{
+    PixmapCacheKey() : selected(false), theme(0), scale(0), dpr(0) {}
+    bool operator==(const PixmapCacheKey& o) const
+    {
+        return size == o.size && selected == o.selected && theme == o.theme &&
+            qFuzzyCompare(scale, o.scale) && qFuzzyCompare(dpr, o.dpr);
+    }
+    QSize size;
+    bool selected;
+    ThemeInterface* theme;
+    qreal scale;
+    qreal dpr;
+};
+
+// an item's cached rendering at one detail level, and what it was made for
+struct CachedPixmap
+{
+    CachedPixmap(const PixmapCacheKey& k, const QPixmap& p) : key(k), pixmap(p) {}
+    PixmapCacheKey key;
+    QPixmap pixmap;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 
 class ItemDataBase : public QObject
@@ -119,42 +295,69 @@ class ItemDataBase : public QObject
     Q_OBJECT
 public:
     static QString joinTexts(const QStringList & texts, const QString& seperator);
-    explicit ItemDataBase(DiagramItem *item) : QObject(0) {m_item = item;}
+    static QStringList splitEscapedTexts(const QString& text);
+    static bool readRecord(QXmlStreamReader& xml, ControlRecord& record);
+    static bool readRecords(QXmlStreamReader& xml, RecordSink& sink);
+    static void writeRecord(QXmlStreamWriter& xml, const ControlRecord& record);
+    ItemDataBase(DiagramItem *item, LayoutContext* context) : QObject(0), m_cached(false) {m_item = item; m_context = context;}
+    ~ItemDataBase();
     DiagramItem* item() {return m_item;}
+    LayoutContext* context() {return m_context;}
 
     void init();
+    void init(const ControlRecord& record);
+    void layout(bool toMeasuredSize);
     void update(bool toMeasuredSize);
-    bool load(const QDomElement& element);
-    static DiagramItem* sload(const QDomElement& element);
-    bool save(QDomDocument& doc, QDomElement& element);
+    bool load(const ControlRecord& record);
+    static DiagramItem* sload(const ControlRecord& record, LayoutContext* context = NULL);
+    void save(ControlRecord& record);
+    void save(QXmlStreamWriter& xml);
     bool load(const QString& xml);
     bool save(QString& xml);
+    const QString& xmlFragment();
+    void invalidateXmlCache() {m_xmlCache.clear();}
     void setProperty(const QString& sProp, const QString& sValue);
     const QSize& mesuredSize() {return m_measuredSize;}
+    const DisplayList& displayList() {if (m_drawingSequence.length() == 0) calculateDrawingSequence(); return m_drawingSequence;}
     int groupId();
     DiagramItemGroup* group();
     QRect posRect();
-    void posRect_changed() {calculateDrawingSequence();}
+    void posRect_changed() {invalidateCache(); invalidateXmlCache(); calculateDrawingSequence();}
     void paint(QPainter *painter, const QStyleOptionGraphicsItem *option);
+    void invalidateCache();
+    static DetailLevel detailLevel(qreal lod);
 
 protected:
-    void addPropertyToDomElement(QDomDocument& doc, QDomElement& props);
-    const QList<Graphy>& drawingSequence() {return m_drawingSequence;}
+    void applyRecord(const ControlRecord& record);
+    void saveProperties(ControlRecord& record);
+    const DisplayList& drawingSequence() {return m_drawingSequence;}
     DiagramItem* m_item;
-    QList<Graphy> m_drawingSequence;
+    LayoutContext* m_context;
+    DisplayList m_drawingSequence;
     QSize m_measuredSize;
     void pTrimText();
-    void addFrameGraphy(const QRect& rc);
-    void addBackgroundGraphy(const QRect& rc, ColorType clrType);
+    void addFrameGraphy(const QRect& rc, StyleSample style = SampleFrame);
+    void addBackgroundGraphy(const QRect& rc, ColorType clrType, const QColor& userClr = QColor());
     void addLineGraphy(const QRect& rc);
-    void addTextGraphy(const QRect& rc, int textFlags, const QString& text);
+    void addTextGraphy(const QRect& rc, int textFlags, const QString& text, const QFont* font = NULL);
+    void addLinkTextGraphy(const QRect& rc, int textFlags, const QString& text, const QFont* font = NULL);
     void addVScrollbarGraphy(const QRect& rc, int value);
-    void addImageGraphy(const QRect& rc, QPixmap* pm);
+    void addImageGraphy(const QRect& rc, const QImage* image);
+    int textWidth(const QString& t, const QFont* font = NULL) {return m_context->textWidth(t, font);}
+    int textHeight(const QString& t, int w, const QFont* font = NULL) {return m_context->textHeight(t, w, font);}
+    int textHeight(const QFont* font = NULL) {return m_context->textHeight(font);}
+    void paintSequence(QPainter *painter, const QStyleOptionGraphicsItem *option, ThemeInterface* theme,
+        DetailLevel level, const QRectF& exposed = QRectF());
+    QString m_xmlCache;
+    // set once the item was painted into the shared pixmap cache; items
+    // laid out on load workers never touch that cache
+    bool m_cached;
 
 public:
     virtual ResizeMode resizeMode() {return ResizeModeAll;}
-    virtual void propertyChanged(PropertyType type) {if ((type & getProperties()) > 0) update(false);}
+    virtual void propertyChanged(PropertyType type) {invalidateCache(); invalidateXmlCache(); if ((type & getProperties()) > 0) update(false);}
     virtual int getProperties() = 0;
+    // plain member values only; measuring is left to layout()
     virtual void setDefaultData() = 0;
     virtual void calculateDrawingSequence() = 0;
     virtual void calculateMesuredSize() = 0;
@@ -210,7 +413,7 @@ protected:
 class NotImplementedYet : public ItemDataBase
 {
 public:
-    explicit NotImplementedYet(DiagramItem *item) : ItemDataBase(item) {}
+    NotImplementedYet(DiagramItem *item, LayoutContext* context) : ItemDataBase(item, context) {}
     virtual int getProperties() {return P_SingleLineText; }
     virtual void setDefaultData();
     virtual void calculateDrawingSequence();
@@ -224,7 +427,7 @@ public:
 class ImageItemData : public ItemDataBase
 {
 public:
-    explicit ImageItemData(DiagramItem *item) : ItemDataBase(item) {}
+    ImageItemData(DiagramItem *item, LayoutContext* context) : ItemDataBase(item, context) {}
     virtual int getProperties() {return 0;}
     virtual void calculateMesuredSize() {}
     virtual void setDefaultData();
@@ -232,7 +435,6 @@ public:
 protected:
     QString m_sImage;
     QImage m_image;
-    QPixmap m_pixmap;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -240,7 +442,7 @@ protected:
 class Accordion : public ItemDataBase
 {
 public:
-    explicit Accordion(DiagramItem *item) : ItemDataBase(item) {}
+    Accordion(DiagramItem *item, LayoutContext* context) : ItemDataBase(item, context) {}
     virtual int getProperties() {return P_MultilineTexts|P_SelectedIndex|P_VScrollBar|P_Value|P_AutoSize; }
     virtual void setDefaultData();
     virtual void calculateDrawingSequence();
@@ -258,7 +460,7 @@ private:
 class AlertBox : public ItemDataBase
 {
 public:
-    explicit AlertBox(DiagramItem *item) : ItemDataBase(item) {}
+    AlertBox(DiagramItem *item, LayoutContext* context) : ItemDataBase(item, context) {}
     virtual int getProperties() {return P_MultilineTexts | P_AutoSize; }
     virtual void setDefaultData();
     virtual void calculateDrawingSequence();
@@ -276,7 +478,7 @@ private:
 class Breadcrumbs : public ItemDataBase
 {
 public:
-    explicit Breadcrumbs(DiagramItem *item) : ItemDataBase(item) {}
+    Breadcrumbs(DiagramItem *item, LayoutContext* context) : ItemDataBase(item, context) {}
     virtual int getProperties() {return P_SingleLineText | P_Font; }
     virtual void setDefaultData();
     virtual void calculateDrawingSequence();
@@ -291,7 +493,7 @@ private:
 class BrowserWindow : public ItemDataBase
 {
 public:
-    explicit BrowserWindow(DiagramItem *item) : ItemDataBase(item) {}
+    BrowserWindow(DiagramItem *item, LayoutContext* context) : ItemDataBase(item, context) {}
     virtual int getProperties() {return P_VScrollBar | P_Value | P_MultilineTexts; }
     virtual void setDefaultData();
     virtual void calculateDrawingSequence();
@@ -303,7 +505,7 @@ public:
 class Button : public ItemDataBase
 {
 public:
-    explicit Button(DiagramItem *item) : ItemDataBase(item) {}
+    Button(DiagramItem *item, LayoutContext* context) : ItemDataBase(item, context) {}
     virtual int getProperties() {return P_AutoSize | P_Color | P_SingleLineText | P_Font | P_Icon | P_State; }
     virtual void setDefaultData();
     virtual void calculateDrawingSequence();
@@ -7,6 +7,11 @@
 #include "flowlayout.h"
 #include "palette.hxx"
 #include "itemdata.hxx"
+#include "binarydocument.hxx"
+#include "documentloader.hxx"
+#include "vectorexport.hxx"
+
+#define OPEN_PROGRESS_DELAY_MS              500
 
 #define ADD_DIAGRAM_TO_LIB(key, flag, image) \
     if ((group & (flag)) > 0)\
@@ -16,7 +21,6 @@
     }
 
 MainWindow* MainWindow::m_instance = NULL;
-static ThemeStyleSheet g_theme;
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
@@ -28,7 +32,10 @@ MainWindow::MainWindow(QWidget *parent)
     setupDiagramLibrary(GroupAll);
     dockWidgetNeverShow->setVisible(false);
     m_undoGroup = new QUndoGroup(this);
-    m_currentTheme = &g_theme;
+    m_currentTheme = LayoutContext::defaultContext()->theme();
+    m_actionStateValid = false;
+    m_clipboardHasItems = Document::isValidItemsText(QApplication::clipboard()->text());
+    connect(QApplication::clipboard(), SIGNAL(dataChanged()), this, SLOT(clipboardChanged()));
 
     QWidget *w = documentTabs->widget(0);
     documentTabs->removeTab(0);
@@ -229,7 +236,7 @@ void MainWindow::btnClicked()
 void MainWindow::openDocument()
 {
     QString fileName = QFileDialog::getOpenFileName(this, tr("Open File"), QString(), 
-        tr("Text files (*.txt)"));
+        tr("Wireframe files (*.txt *.wfb)"));
     if (fileName.isEmpty())
         return;
 
@@ -238,18 +245,50 @@ void MainWindow::openDocument()
         QMessageBox::warning(this, tr("File error"), tr("Failed to open\n%1").arg(fileName));
         return;
     }
-    //QTextStream stream(&file);
+    file.close();
 
+    // the tab is added right away and fills in as the file loads; the
+    // loader goes away with the document if the tab is closed first
     Document *doc = Document::createDocument(this);
-    if (!doc->load(file)) 
+    doc->setFileName(fileName);
+    addDocument(doc);
+
+    DocumentLoader* loader = new DocumentLoader(doc->scene(), NULL, NULL, doc);
+    QProgressDialog* progress = new QProgressDialog(tr("Opening %1").arg(QFileInfo(fileName).fileName()),
+        tr("Cancel"), 0, 100, this);
+    progress->setWindowModality(Qt::NonModal);
+    progress->setMinimumDuration(OPEN_PROGRESS_DELAY_MS);
+    connect(loader, SIGNAL(progressChanged(int)), progress, SLOT(setValue(int)));
+    connect(progress, SIGNAL(canceled()), loader, SLOT(cancel()));
+    connect(loader, SIGNAL(destroyed()), progress, SLOT(deleteLater()));
+    connect(loader, SIGNAL(finished(bool)), progress, SLOT(deleteLater()));
+    connect(loader, SIGNAL(finished(bool)), this, SLOT(documentLoaded(bool)));
+    loader->start(fileName);
+    updateActions();
+}
+
+// saving a document that is still loading would write only part of it
+bool MainWindow::isLoading(Document *doc) const
+{
+    return doc->findChild<DocumentLoader*>() != NULL;
+}
+
+// a cancelled or failed open drops its tab
+void MainWindow::documentLoaded(bool ok)
+{
+    DocumentLoader* loader = qobject_cast<DocumentLoader*>(sender());
+    Document* doc = qobject_cast<Document*>(loader->parent());
+    if (ok)
     {
-        QMessageBox::warning(this, tr("Parse error"), tr("Failed to parse\n%1").arg(fileName));
-        delete doc;
+        loader->setParent(NULL);
+        loader->deleteLater();
+        updateActions();
         return;
     }
-
-    doc->setFileName(fileName);
-    addDocument(doc);
+    removeDocument(doc);
+    if (!loader->isCancelled())
+        QMessageBox::warning(this, tr("Parse error"), tr("Failed to parse\n%1").arg(doc->fileName()));
+    doc->deleteLater();
 }
 
 QString MainWindow::getWindowTitle(const Document *doc) const
@@ -319,6 +358,7 @@ void MainWindow::removeDocument(Document *doc)
 
     documentTabs->removeTab(index);
     m_undoGroup->removeStack(doc->undoStack());
+    m_actionStateValid = false;
     disconnect(doc->undoStack(), SIGNAL(indexChanged(int)), this, SLOT(updateActions()));
     disconnect(doc->undoStack(), SIGNAL(cleanChanged(bool)), this, SLOT(updateActions()));
 
@@ -331,7 +371,7 @@ void MainWindow::removeDocument(Document *doc)
 void MainWindow::saveDocument()
 {
     Document *doc = currentDocument();
-    if (doc == 0)
+    if (doc == 0 || isLoading(doc))
         return;
 
     for (;;) {
@@ -339,7 +379,7 @@ void MainWindow::saveDocument()
 
         if (fileName.isEmpty())
             fileName = QFileDialog::getSaveFileName(this, tr("Save File"), QString(), 
-                tr("Text files (*.txt)"));
+                tr("Text files (*.txt);;Binary files (*.wfb)"));
         if (fileName.isEmpty())
             break;
 
@@ -350,8 +390,21 @@ void MainWindow::saveDocument()
                                 tr("Failed to open\n%1").arg(fileName));
             doc->setFileName(QString());
         } else {
-            QTextStream stream(&file);
-            doc->save(stream);
+            bool saved;
+            if (BinaryDocument::isBinaryFileName(fileName))
+                saved = doc->saveBinary(file);
+            else
+            {
+                QTextStream stream(&file);
+                saved = doc->save(stream);
+            }
+            if (!saved) {
+                QMessageBox::warning(this,
+                                    tr("File error"),
+                                    tr("Failed to save\n%1").arg(fileName));
+                doc->setFileName(QString());
+                continue;
+            }
             doc->setFileName(fileName);
 
             int index = documentTabs->indexOf(doc);
@@ -369,7 +422,7 @@ void MainWindow::closeDocument()
     if (doc == 0)
         return;
 
-    if (!doc->undoStack()->isClean()) {
+    if (!doc->undoStack()->isClean() && !isLoading(doc)) {
         int button
             = QMessageBox::warning(this,
                             tr("Unsaved changes"),
@@ -409,26 +462,61 @@ void MainWindow::addDiagram(const QModelIndex & index)
     doc->undoStack()->push(new AddDiagramItemCommand(doc, key));
 }
 
+// the clipboard is only read when it changes, not on every updateActions()
+void MainWindow::clipboardChanged()
+{
+    bool hasItems = Document::isValidItemsText(QApplication::clipboard()->text());
+    if (hasItems == m_clipboardHasItems)
+        return;
+    m_clipboardHasItems = hasItems;
+    updateActions();
+}
+
 void MainWindow::updateActions()
 {
     Document *doc = currentDocument();
+
+    // everything the actions depend on; nothing to do when none of it
+    // changed since the last call
+    ActionState state;
+    state.doc = doc;
+    if (doc != 0)
+    {
+        state.undoIndex = doc->undoStack()->index();
+        state.clean = doc->undoStack()->isClean();
+        state.hasItems = doc->scene()->topLevelItemCount() > 0;
+        state.selectionCount = doc->selection()->count();
+        state.selectionStamp = doc->scene()->selectionStamp();
+        state.firstSelected = doc->selection()->first();
+        state.gridVisible = doc->scene()->isGridVisible();
+        state.loading = isLoading(doc);
+    }
+    state.canPaste = doc != 0 && m_clipboardHasItems;
+    if (m_actionStateValid && state == m_actionState)
+        return;
+    m_actionState = state;
+    m_actionStateValid = true;
+
     m_undoGroup->setActiveStack(doc == 0 ? 0 : doc->undoStack());
     actionClose->setEnabled(doc != 0);
-    actionSave->setEnabled(doc != 0 && !doc->undoStack()->isClean());
-    actionSave_as_PNG->setEnabled(doc != 0);
-
-    bool hasSelection = doc != 0 && doc->scene()->selectedSortedItems().length() > 0;
-    bool hasSingleSelection = hasSelection && doc->scene()->selectedSortedItems().length() == 1;
-    bool hasSingleDiagramItemSelection = hasSingleSelection && (doc->scene()->selectedSortedItems().at(0)->type() == DiagramItem::Type);
-    bool hasMultiSelection = doc != 0 && doc->scene()->selectedSortedItems().length() > 1;
-    bool hasItems = doc != 0 && doc->scene()->items().length() > 0;
+    bool canSave = doc != 0 && !state.loading;
+    actionSave->setEnabled(canSave && !state.clean);
+    actionSave_as_PNG->setEnabled(canSave);
+    actionSave_as_PDF->setEnabled(canSave);
+    actionSave_as_XML->setEnabled(canSave);
+
+    bool hasSelection = state.selectionCount > 0;
+    bool hasSingleSelection = state.selectionCount == 1;
+    bool hasMultiSelection = state.selectionCount > 1;
+    bool hasItems = state.hasItems;
     if (hasSelection)
     {
         int props = 0;
         ItemDataBase* itemData = NULL;
-        if (hasSingleDiagramItemSelection)
+        DiagramItem* ditem = doc->selection()->singleDiagramItem();
+        if (ditem != NULL)
         {
-            itemData = ((DiagramItem*)(doc->scene()->selectedSortedItems().at(0)))->itemData();
+            itemData = ditem->itemData();
             props = itemData->getProperties();
         }
         m_palette->showWindow(true, doc, props, itemData);
@@ -441,8 +529,7 @@ void MainWindow::updateActions()
     actionCut->setEnabled(hasSelection);
     actionCopy->setEnabled(hasSelection);
 
-    QString clipboardText = QApplication::clipboard()->text();
-    actionPaste->setEnabled(doc != 0 && Document::isValidItemsText(clipboardText));
+    actionPaste->setEnabled(state.canPaste);
 
     actionDelete->setEnabled(hasSelection);
     actionSelectAll->setEnabled(hasItems);
@@ -453,18 +540,14 @@ void MainWindow::updateActions()
     actionLock->setEnabled(hasSelection);
     actionUnlock_All->setEnabled(hasItems);
 
-    actionShow_Paper->setChecked(doc != 0 && doc->scene()->isGridVisible());
+    actionShow_Paper->setChecked(state.gridVisible);
 
     actionZoom_In->setEnabled(doc != 0);
     actionZoom_Out->setEnabled(doc != 0);
     actionZoom_1_1->setEnabled(doc != 0);
 
-    if (hasSingleSelection)
-    {
-        QGraphicsItem* item = doc->scene()->selectedSortedItems().at(0);
-        if (qgraphicsitem_cast<DiagramItemGroup*> (item) != NULL)
-            actionUngroup->setEnabled(true);
-    }
+    if (hasSingleSelection && doc->selection()->containsGroup())
+        actionUngroup->setEnabled(true);
     if (doc != 0)
     {
         int index = documentTabs->indexOf(doc);
@@ -485,8 +568,6 @@ void MainWindow::updateActions()
     m_palette->btnUp->setEnabled(hasSingleSelection);
     m_palette->btnDown->setEnabled(hasSingleSelection);
 
-    actionSave_as_PDF->setEnabled(false);
-    actionSave_as_XML->setEnabled(false);
     actionZoom_To_Fit->setEnabled(false);
     actionFull_Screen->setEnabled(false);
 }
@@ -521,9 +602,50 @@ void MainWindow::saveAsPng()
 
 void MainWindow::saveAsPdf()
 {
+    Document *doc = currentDocument();
+    if (doc == 0)
+        return;
+
+    QString svgFilter = tr("SVG files (*.svg)");
+    QString filter;
+    QString fileName = QFileDialog::getSaveFileName(this, tr("Save File"), QString(), 
+        tr("PDF files (*.pdf)") + ";;" + svgFilter, &filter);
+    if (fileName.isEmpty())
+        return;
+    if (!VectorExporter::isVectorFormat(QFileInfo(fileName).suffix()))
+        fileName += filter == svgFilter ? ".svg" : ".pdf";
+    if (!doc->saveVector(fileName))
+    {
+        QMessageBox::warning(this,
+            tr("File error"),
+            tr("Failed to save\n%1").arg(fileName));
+    }
 }
 void MainWindow::saveAsXml()
 {
+    Document *doc = currentDocument();
+    if (doc == 0)
+        return;
+
+    QString fileName = QFileDialog::getSaveFileName(this, tr("Save File"), QString(), 
+        tr("Text files (*.txt)"));
+    if (fileName.isEmpty())
+        return;
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        QMessageBox::warning(this,
+            tr("File error"),
+            tr("Failed to open\n%1").arg(fileName));
+        return;
+    }
+    QTextStream stream(&file);
+    if (!doc->writeXml(stream))
+    {
+        QMessageBox::warning(this,
+            tr("File error"),
+            tr("Failed to save\n%1").arg(fileName));
+    }
 }
 void MainWindow::cut()
 {
@@ -534,7 +656,7 @@ void MainWindow::cut()
     if (clipboard)
     {
         QMimeData *mimeData = new QMimeData;
-        QList<ResizableItem*> items = doc->scene()->selectedSortedItems();
+        QList<ResizableItem*> items = doc->selection()->items();
         mimeData->setText(Document::serializeItemsToText(items));
         clipboard->setMimeData(mimeData);
         doc->undoStack()->push(new CutCommand(items, doc->scene()));
@@ -550,7 +672,7 @@ void MainWindow::copy()
     if (clipboard)
     {
         QMimeData *mimeData = new QMimeData;
-        mimeData->setText(Document::serializeItemsToText(doc->scene()->selectedSortedItems()));
+        mimeData->setText(Document::serializeItemsToText(doc->selection()->items()));
         clipboard->setMimeData(mimeData);
     }
     updateActions();
@@ -581,7 +703,7 @@ void MainWindow::deleteObjects()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    doc->undoStack()->push(new RemoveDiagramItemsCommand(doc, doc->scene()->selectedSortedItems()));
+    doc->undoStack()->push(new RemoveDiagramItemsCommand(doc, doc->selection()->items()));
     updateActions();
 }
 
@@ -590,8 +712,7 @@ void MainWindow::selectAll()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    foreach(ResizableItem* item, doc->scene()->topLevelSortedItems())
-        item->setSelected(true);
+    doc->scene()->selectAllItems();
     updateActions();
 }
 void MainWindow::selectNone()
@@ -599,8 +720,8 @@ void MainWindow::selectNone()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    foreach(ResizableItem* item, doc->scene()->topLevelSortedItems())
-        item->setSelected(false);
+    // clearSelection() emits selectionChanged once for the whole change
+    doc->scene()->clearSelection();
     updateActions();
 }
 void MainWindow::groupObjects()
@@ -608,7 +729,7 @@ void MainWindow::groupObjects()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    doc->undoStack()->push(new GroupCommand(doc->scene()->selectedSortedItems(), doc->scene()));
+    doc->undoStack()->push(new GroupCommand(doc->selection()->items(), doc->scene()));
     updateActions();
 }
 void MainWindow::ungroup()
@@ -616,9 +737,9 @@ void MainWindow::ungroup()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    if (doc->scene()->selectedSortedItems().length() > 0)
+    if (doc->selection()->items().length() > 0)
     {
-        ResizableItem* item = doc->scene()->selectedSortedItems().at(0);
+        ResizableItem* item = doc->selection()->items().at(0);
         DiagramItemGroup* gitem = qgraphicsitem_cast<DiagramItemGroup*> (item);
         if (gitem != NULL)
             doc->undoStack()->push(new UngroupCommand(gitem));
@@ -631,7 +752,7 @@ void MainWindow::lock()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    doc->undoStack()->push(new LockCommand(doc->scene()->selectedSortedItems()));
+    doc->undoStack()->push(new LockCommand(doc->selection()->items()));
     updateActions();
 }
 
@@ -707,7 +828,7 @@ void MainWindow::moveFront()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    doc->undoStack()->push(new MoveFrontCommand(doc->scene()->selectedSortedItems()));
+    doc->undoStack()->push(new MoveFrontCommand(doc->selection()->items()));
     updateActions();
 }
 
@@ -716,7 +837,7 @@ void MainWindow::moveBack()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    doc->undoStack()->push(new MoveBackCommand(doc->scene()->selectedSortedItems()));
+    doc->undoStack()->push(new MoveBackCommand(doc->selection()->items()));
     updateActions();
 }
 
@@ -725,9 +846,9 @@ void MainWindow::moveUp()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    if (doc->scene()->selectedSortedItems().length() != 1)
+    if (doc->selection()->items().length() != 1)
         return;
-    doc->undoStack()->push(new MoveUpCommand(doc->scene()->selectedSortedItems()[0]));
+    doc->undoStack()->push(new MoveUpCommand(doc->selection()->items()[0]));
     updateActions();
 }
 
@@ -736,8 +857,8 @@ void MainWindow::moveDown()
     Document *doc = currentDocument();
     if (doc == NULL)
         return;
-    if (doc->scene()->selectedSortedItems().length() != 1)
+    if (doc->selection()->items().length() != 1)
         return;
-    doc->undoStack()->push(new MoveDownCommand(doc->scene()->selectedSortedItems()[0]));
+    doc->undoStack()->push(new MoveDownCommand(doc->selection()->items()[0]));
     updateActions();
 }
@@ -9,6 +9,35 @@ QT_FORWARD_DECLARE_CLASS(QUndoGroup)
 class Document;
 class Palette;
 class ThemeInterface;
+class ResizableItem;
+
+// the facts MainWindow::updateActions derives the action states from
+struct ActionState
+{
+    ActionState() : doc(NULL), undoIndex(-1), clean(true), hasItems(false), 
+        selectionCount(0), selectionStamp(-1), firstSelected(NULL), gridVisible(false), canPaste(false), loading(false) {}
+    bool operator==(const ActionState& other) const
+    {
+        return doc == other.doc && undoIndex == other.undoIndex && clean == other.clean
+            && hasItems == other.hasItems && selectionCount == other.selectionCount
+            && selectionStamp == other.selectionStamp
+            && firstSelected == other.firstSelected && gridVisible == other.gridVisible
+            && canPaste == other.canPaste && loading == other.loading;
+    }
+    Document* doc;
+    int undoIndex;
+    bool clean;
+    bool hasItems;
+    int selectionCount;
+    // bumped by the scene on any change to the selection or to the geometry
+    // and z-order of a selected item; merged move and resize commands keep
+    // the undo index, and the palette shows the geometry
+    int selectionStamp;
+    ResizableItem* firstSelected;
+    bool gridVisible;
+    bool canPaste;
+    bool loading;
+};
 
 class MainWindow : public QMainWindow, public Ui::MainWindow
 {
@@ -59,12 +88,15 @@ public Q_SLOTS:
 
     void btnClicked();
     void updateActions();
+    void clipboardChanged();
     void addDiagram(const QModelIndex & index);
+    void documentLoaded(bool ok);
 
 private:
     void setupButtonsLayout(QWidget * pButtonsArea);
     void setupDiagramLibrary(int group);
     QString getWindowTitle(const Document *doc) const;
+    bool isLoading(Document *doc) const;
     Palette *m_palette;
     QAction *m_undoAction;
     QAction *m_redoAction;
@@ -75,6 +107,10 @@ private:
 
     ThemeInterface* m_currentTheme;
 
+    bool m_clipboardHasItems;
+    ActionState m_actionState;
+    bool m_actionStateValid;
+
     static MainWindow* m_instance;
 };
 
@@ -80,12 +80,10 @@ void Palette::showWindow(bool show, Document* doc, int props, ItemDataBase* item
             .arg(pos.width())
             .arg(pos.height()));
     }
-    else if (show && doc && doc->scene()->selectedSortedItems().length() > 0)
+    else if (show && doc && !doc->selection()->isEmpty())
     {
         labelTitle->setText("multiple items or group");
-        QRectF pos;
-        foreach (ResizableItem* item, doc->scene()->selectedSortedItems())
-            pos |= item->posRect();
+        QRectF pos = doc->selection()->unionRect();
         QString s = ("Pos(%1,%2), Size(%3x%4)");
         labelPosSize->setText(s.arg(pos.x())
             .arg(pos.y())
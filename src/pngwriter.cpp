@@ -0,0 +1,192 @@
+#include "pngwriter.hxx"
+#include <QIODevice>
+#include <QImage>
+#include <QtEndian>
+#include <QtZlib/zlib.h>
+
+#define PNG_SIGNATURE                       "\x89PNG\r\n\x1a\n"
+#define PNG_COLOR_RGB                       2
+#define PNG_PIXEL_BYTES                     3
+#define PNG_FILTER_COUNT                    5 // none, sub, up, average, paeth
+#define IDAT_CHUNK_SIZE                     65536
+
+///////////////////////////////////////////////////////////////////////////////
+
+PngWriter::PngWriter(QIODevice* device)
+    : m_device(device), m_stream(NULL), m_width(0), m_height(0), m_rowsWritten(0)
+{
+}
+
+PngWriter::~PngWriter()
+{
+    if (m_stream != NULL)
+    {
+        deflateEnd(m_stream);
+        delete m_stream;
+    }
+}
+
+int paethPredictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = qAbs(p - a);
+    int pb = qAbs(p - b);
+    int pc = qAbs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// row filtered with the png filter type into out; returns the sum of the
+// filtered bytes taken as signed, which the filter with the least wins
+int applyFilter(int type, const uchar* row, const uchar* prev, int length, uchar* out)
+{
+    int sum = 0;
+    for (int i=0; i<length; i++)
+    {
+        int a = i >= PNG_PIXEL_BYTES ? row[i - PNG_PIXEL_BYTES] : 0;
+        int b = prev[i];
+        int c = i >= PNG_PIXEL_BYTES ? prev[i - PNG_PIXEL_BYTES] : 0;
+        int predicted;
+        switch (type)
+        {
+        case 1:
+            predicted = a;
+            break;
+        case 2:
+            predicted = b;
+            break;
+        case 3:
+            predicted = (a + b) / 2;
+            break;
+        case 4:
+            predicted = paethPredictor(a, b, c);
+            break;
+        default:
+            predicted = 0;
+            break;
+        }
+        out[i] = (uchar)(row[i] - predicted);
+        sum += qAbs((int)(signed char)out[i]);
+    }
+    return sum;
+}
+
+bool PngWriter::writeChunk(const char* type, const QByteArray& data)
+{
+    uchar length[4];
+    qToBigEndian<quint32>(data.size(), length);
+    uLong crc = crc32(0, (const Bytef*)type, 4);
+    crc = crc32(crc, (const Bytef*)data.constData(), data.size());
+    uchar crcBytes[4];
+    qToBigEndian<quint32>(crc, crcBytes);
+    return m_device->write((const char*)length, 4) == 4 && m_device->write(type, 4) == 4 &&
+        m_device->write(data) == data.size() && m_device->write((const char*)crcBytes, 4) == 4;
+}
+
+bool PngWriter::begin(int width, int height)
+{
+    if (width <= 0 || height <= 0 || m_stream != NULL)
+        return false;
+    m_width = width;
+    m_height = height;
+    m_rowsWritten = 0;
+
+    m_stream = new z_stream_s;
+    memset(m_stream, 0, sizeof(z_stream_s));
+    if (deflateInit(m_stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        delete m_stream;
+        m_stream = NULL;
+        return false;
+    }
+    m_out.resize(IDAT_CHUNK_SIZE);
+    m_row.resize(width * PNG_PIXEL_BYTES);
+    m_trial.resize(width * PNG_PIXEL_BYTES);
+    m_prevRow.fill(0, width * PNG_PIXEL_BYTES);
+
+    QByteArray header(13, 0);
+    qToBigEndian<quint32>(width, (uchar*)header.data());
+    qToBigEndian<quint32>(height, (uchar*)header.data() + 4);
+    header[8] = 8; // bit depth
+    header[9] = PNG_COLOR_RGB;
+    // compression, filter and interlace methods stay 0
+    return m_device->write(PNG_SIGNATURE, 8) == 8 && writeChunk("IHDR", header);
+}
+
+bool PngWriter::deflateRows(const QByteArray& rows, bool finish)
+{
+    m_stream->next_in = (Bytef*)rows.constData();
+    m_stream->avail_in = rows.size();
+    int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+    for (;;)
+    {
+        m_stream->next_out = (Bytef*)m_out.data();
+        m_stream->avail_out = m_out.size();
+        int ret = deflate(m_stream, flush);
+        if (ret == Z_STREAM_ERROR)
+            return false;
+        int produced = m_out.size() - m_stream->avail_out;
+        if (produced > 0 && !writeChunk("IDAT", QByteArray::fromRawData(m_out.constData(), produced)))
+            return false;
+        if (finish ? ret == Z_STREAM_END : m_stream->avail_out != 0)
+            return true;
+    }
+}
+
+bool PngWriter::writeRows(const QImage& band)
+{
+    if (m_stream == NULL || band.width() != m_width || m_rowsWritten + band.height() > m_height)
+        return false;
+    if (band.format() != QImage::Format_RGB32 && band.format() != QImage::Format_ARGB32)
+        return writeRows(band.convertToFormat(QImage::Format_RGB32));
+    // each row is its filter type byte and the filtered RGB triples
+    int rowSize = 1 + m_width * PNG_PIXEL_BYTES;
+    m_rows.resize(rowSize * band.height());
+    uchar* out = (uchar*)m_rows.data();
+    for (int y=0; y<band.height(); y++, out += rowSize)
+    {
+        const QRgb* line = (const QRgb*)band.constScanLine(y);
+        uchar* rgb = (uchar*)m_row.data();
+        for (int x=0; x<m_width; x++)
+        {
+            *rgb++ = qRed(line[x]);
+            *rgb++ = qGreen(line[x]);
+            *rgb++ = qBlue(line[x]);
+        }
+        filterRow(out);
+        qSwap(m_row, m_prevRow);
+    }
+    m_rowsWritten += band.height();
+    return deflateRows(m_rows, false);
+}
+
+// m_row with the filter that suits it best, against m_prevRow
+void PngWriter::filterRow(uchar* out)
+{
+    const uchar* row = (const uchar*)m_row.constData();
+    const uchar* prev = (const uchar*)m_prevRow.constData();
+    uchar* trial = (uchar*)m_trial.data();
+    int length = m_row.size();
+    int best = -1;
+    for (int type=0; type<PNG_FILTER_COUNT; type++)
+    {
+        int sum = applyFilter(type, row, prev, length, trial);
+        if (best >= 0 && sum >= best)
+            continue;
+        best = sum;
+        out[0] = type;
+        memcpy(out + 1, trial, length);
+    }
+}
+
+bool PngWriter::end()
+{
+    if (m_stream == NULL || m_rowsWritten != m_height)
+        return false;
+    bool ok = deflateRows(QByteArray(), true) && writeChunk("IEND", QByteArray());
+    deflateEnd(m_stream);
+    delete m_stream;
+    m_stream = NULL;
+    return ok;
+}
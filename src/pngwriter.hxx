@@ -0,0 +1,45 @@
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <QByteArray>
+
+class QIODevice;
+class QImage;
+struct z_stream_s;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// writes an 8-bit RGB png a band of rows at a time, so an image of any size
+// never has to be in memory at once. each row gets the png filter that
+// leaves it the smallest sum of differences, as libpng picks them, and the
+// rows go through one deflate stream that is flushed into IDAT chunks as
+// its output buffer fills.
+class PngWriter
+{
+public:
+    explicit PngWriter(QIODevice* device);
+    ~PngWriter();
+
+    bool begin(int width, int height);
+    // appends the rows of band; it must be as wide as the image
+    bool writeRows(const QImage& band);
+    bool end();
+
+private:
+    bool writeChunk(const char* type, const QByteArray& data);
+    bool deflateRows(const QByteArray& rows, bool finish);
+    void filterRow(uchar* out);
+
+    QIODevice* m_device;
+    z_stream_s* m_stream;
+    int m_width;
+    int m_height;
+    int m_rowsWritten;
+    QByteArray m_rows;
+    QByteArray m_row;       // the RGB bytes of the row being filtered
+    QByteArray m_prevRow;   // and of the one above it, zeros for the first
+    QByteArray m_trial;
+    QByteArray m_out;
+};
+
+#endif // PNGWRITER_H
@@ -4,7 +4,11 @@
 #
 #-------------------------------------------------
 
-QT       += core gui xml widgets
+QT       += core gui xml widgets concurrent svg
+
+# the png export streams through zlib directly; this is the zlib Qt itself
+# uses, bundled or the system's, so no extra library is needed
+QT       += zlib-private
 
 DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0
 
@@ -18,14 +22,34 @@ SOURCES += main.cpp\
     commands.cpp \
     flowlayout.cpp \
     palette.cpp \
-    itemdata.cpp
+    itemdata.cpp \
+    textmetrics.cpp \
+    binarydocument.cpp \
+    snapindex.cpp \
+    selectionmodel.cpp \
+    stylecache.cpp \
+    pngwriter.cpp \
+    imageexport.cpp \
+    batchexport.cpp \
+    vectorexport.cpp \
+    documentloader.cpp
 
 HEADERS  += mainwindow.hxx \
     document.hxx \
     commands.h \
     flowlayout.h \
     palette.hxx \
-    itemdata.hxx
+    itemdata.hxx \
+    textmetrics.hxx \
+    binarydocument.hxx \
+    snapindex.hxx \
+    selectionmodel.hxx \
+    stylecache.hxx \
+    pngwriter.hxx \
+    imageexport.hxx \
+    batchexport.hxx \
+    vectorexport.hxx \
+    documentloader.hxx
 
 FORMS    += mainwindow.ui \
     palette.ui
@@ -0,0 +1,55 @@
+#include "selectionmodel.hxx"
+#include "document.hxx"
+
+///////////////////////////////////////////////////////////////////////////////
+
+SelectionModel::SelectionModel(DiagramScene* scene)
+{
+    m_scene = scene;
+    m_stamp = scene->selectionStamp() - 1;
+    m_diagramKey = -1;
+    m_containsGroup = false;
+}
+
+const QList<ResizableItem*>& SelectionModel::items()
+{
+    refresh();
+    return m_items;
+}
+
+DiagramItem* SelectionModel::singleDiagramItem()
+{
+    refresh();
+    if (m_items.length() != 1 || m_items.at(0)->type() != DiagramItem::Type)
+        return NULL;
+    return (DiagramItem*)m_items.at(0);
+}
+
+void SelectionModel::refresh()
+{
+    if (m_stamp == m_scene->selectionStamp())
+        return;
+    m_stamp = m_scene->selectionStamp();
+    m_items = m_scene->selectedSortedItems();
+    m_diagramKey = -1;
+    m_containsGroup = false;
+    m_unionRect = QRectF();
+    for (int i=0; i<m_items.length(); i++)
+    {
+        ResizableItem* item = m_items.at(i);
+        m_unionRect |= item->posRect();
+        if (item->type() == DiagramItemGroup::Type)
+        {
+            m_containsGroup = true;
+            m_diagramKey = -1;
+        }
+        else if (!m_containsGroup)
+        {
+            int key = ((DiagramItem*)item)->key();
+            if (i == 0)
+                m_diagramKey = key;
+            else if (m_diagramKey != key)
+                m_diagramKey = -1;
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef SELECTIONMODEL_H
+#define SELECTIONMODEL_H
+
+#include <QList>
+#include <QRectF>
+
+class DiagramScene;
+class DiagramItem;
+class ResizableItem;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// the current selection of a document, sorted by z-value, and the facts
+// the ui asks about it. everything is worked out once per change: the
+// scene bumps a stamp whenever the selection, or the z-order or geometry
+// of a selected item, changes, and the model refreshes lazily when the
+// stamp moved on.
+
+class SelectionModel
+{
+public:
+    SelectionModel(DiagramScene* scene);
+
+    const QList<ResizableItem*>& items();
+    int count() {refresh(); return m_items.length();}
+    bool isEmpty() {return count() == 0;}
+    ResizableItem* first() {refresh(); return m_items.isEmpty() ? NULL : m_items.at(0);}
+    // the selected item when exactly one plain item is selected
+    DiagramItem* singleDiagramItem();
+    // the key shared by all selected items, -1 if mixed or a group is selected
+    int diagramKey() {refresh(); return m_diagramKey;}
+    bool containsGroup() {refresh(); return m_containsGroup;}
+    QRectF unionRect() {refresh(); return m_unionRect;}
+
+private:
+    void refresh();
+
+    DiagramScene* m_scene;
+    int m_stamp;
+    QList<ResizableItem*> m_items;
+    int m_diagramKey;
+    bool m_containsGroup;
+    QRectF m_unionRect;
+};
+
+#endif // SELECTIONMODEL_H
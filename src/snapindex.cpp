@@ -0,0 +1,503 @@
+#include "snapindex.hxx"
+#include <QtAlgorithms>
+
+// the rect's extent along the snapping axis (horz: x) and across it
+qreal lowEdge(const QRectF& rc, bool horz) {return horz ? rc.left() : rc.top();}
+qreal highEdge(const QRectF& rc, bool horz) {return horz ? rc.right() : rc.bottom();}
+qreal centreLine(const QRectF& rc, bool horz) {return horz ? rc.center().x() : rc.center().y();}
+
+bool overlapsAcross(const QRectF& a, const QRectF& b, bool horz)
+{
+    if (horz)
+        return a.top() < b.bottom() && b.top() < a.bottom();
+    return a.left() < b.right() && b.left() < a.right();
+}
+
+// the segment showing the gap between a (before) and b (after) on the axis
+QLineF gapMark(const QRectF& a, const QRectF& b, bool horz)
+{
+    if (horz)
+    {
+        qreal y = (qMax(a.top(), b.top()) + qMin(a.bottom(), b.bottom())) / 2;
+        return QLineF(a.right(), y, b.left(), y);
+    }
+    qreal x = (qMax(a.left(), b.left()) + qMin(a.right(), b.right())) / 2;
+    return QLineF(x, a.bottom(), x, b.top());
+}
+
+QRectF translatedOnAxis(const QRectF& rc, qreal d, bool horz)
+{
+    return horz ? rc.translated(d, 0) : rc.translated(0, d);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// a segment tree over the elementary segments of the across axis. each
+// node keeps the nearest rect (the one with the smallest key) covering all
+// of it, and the nearest one covering any part of it.
+class CoverTree
+{
+public:
+    CoverTree(int size, const QVector<qreal>& keys)
+        : m_size(size), m_keys(keys), m_tags(4 * size, -1), m_best(4 * size, -1) {}
+
+    void insert(int lo, int hi, int index) {insert(1, 0, m_size, lo, hi, index);}
+    // the nearest rect covering a segment of [lo, hi), or -1
+    int nearest(int lo, int hi) const {return nearest(1, 0, m_size, lo, hi);}
+
+private:
+    int closer(int a, int b) const
+    {
+        if (a < 0)
+            return b;
+        if (b < 0)
+            return a;
+        return m_keys.at(b) < m_keys.at(a) ? b : a;
+    }
+    void insert(int node, int l, int r, int lo, int hi, int index)
+    {
+        if (hi <= l || r <= lo)
+            return;
+        if (lo <= l && r <= hi)
+        {
+            m_tags[node] = closer(m_tags[node], index);
+            m_best[node] = closer(m_best[node], index);
+            return;
+        }
+        int m = (l + r) / 2;
+        insert(2 * node, l, m, lo, hi, index);
+        insert(2 * node + 1, m, r, lo, hi, index);
+        m_best[node] = closer(m_tags[node], closer(m_best[2 * node], m_best[2 * node + 1]));
+    }
+    int nearest(int node, int l, int r, int lo, int hi) const
+    {
+        if (hi <= l || r <= lo)
+            return -1;
+        if (lo <= l && r <= hi)
+            return m_best[node];
+        int m = (l + r) / 2;
+        return closer(m_tags[node], closer(nearest(2 * node, l, m, lo, hi), nearest(2 * node + 1, m, r, lo, hi)));
+    }
+
+    int m_size;
+    const QVector<qreal>& m_keys;
+    QVector<int> m_tags;
+    QVector<int> m_best;
+};
+
+int segmentIndex(const QVector<qreal>& coords, qreal v)
+{
+    return qLowerBound(coords.constBegin(), coords.constEnd(), v) - coords.constBegin();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void SnapIndex::insert(DiagramItem* item, const QRectF& rc)
+{
+    QHash<DiagramItem*, QRectF>::iterator drag = m_dragRects.find(item);
+    if (drag != m_dragRects.end())
+    {
+        drag.value() = rc;
+        return;
+    }
+    QHash<DiagramItem*, QRectF>::const_iterator it = m_rects.constFind(item);
+    if (it != m_rects.constEnd())
+    {
+        if (it.value() == rc)
+            return;
+        remove(item);
+    }
+    m_rects.insert(item, rc);
+    insertLines(item, rc);
+    m_gapsDirty = true;
+}
+
+void SnapIndex::insertLines(DiagramItem* item, const QRectF& rc)
+{
+    m_lefts.insert(rc.left(), item);
+    m_rights.insert(rc.right(), item);
+    m_xCentres.insert(rc.center().x(), item);
+    m_tops.insert(rc.top(), item);
+    m_bottoms.insert(rc.bottom(), item);
+    m_yCentres.insert(rc.center().y(), item);
+    m_widths.insert(rc.width(), item);
+    m_heights.insert(rc.height(), item);
+}
+
+void SnapIndex::remove(DiagramItem* item)
+{
+    if (m_dragRects.remove(item) > 0)
+        return;
+    QHash<DiagramItem*, QRectF>::iterator it = m_rects.find(item);
+    if (it == m_rects.end())
+        return;
+    QRectF rc = it.value();
+    m_rects.erase(it);
+    removeLines(item, rc);
+    m_gapsDirty = true;
+}
+
+void SnapIndex::removeLines(DiagramItem* item, const QRectF& rc)
+{
+    removeLine(m_lefts, rc.left(), item);
+    removeLine(m_rights, rc.right(), item);
+    removeLine(m_xCentres, rc.center().x(), item);
+    removeLine(m_tops, rc.top(), item);
+    removeLine(m_bottoms, rc.bottom(), item);
+    removeLine(m_yCentres, rc.center().y(), item);
+    removeLine(m_widths, rc.width(), item);
+    removeLine(m_heights, rc.height(), item);
+}
+
+void SnapIndex::clear()
+{
+    m_rects.clear();
+    m_lefts.clear();
+    m_rights.clear();
+    m_xCentres.clear();
+    m_tops.clear();
+    m_bottoms.clear();
+    m_yCentres.clear();
+    m_widths.clear();
+    m_heights.clear();
+    m_hGaps.clear();
+    m_vGaps.clear();
+    m_dragRects.clear();
+    m_gapsDirty = true;
+}
+
+void SnapIndex::setDragItems(const QList<DiagramItem*>& items)
+{
+    if (items.isEmpty() && m_dragRects.isEmpty())
+        return;
+    QHash<DiagramItem*, QRectF>::const_iterator it = m_dragRects.constBegin();
+    for (; it != m_dragRects.constEnd(); ++it)
+    {
+        m_rects.insert(it.key(), it.value());
+        insertLines(it.key(), it.value());
+    }
+    m_dragRects.clear();
+    foreach (DiagramItem* item, items)
+    {
+        QHash<DiagramItem*, QRectF>::iterator rect = m_rects.find(item);
+        if (rect == m_rects.end())
+            continue;
+        m_dragRects.insert(item, rect.value());
+        removeLines(item, rect.value());
+        m_rects.erase(rect);
+    }
+    m_gapsDirty = true;
+}
+
+void SnapIndex::removeLine(LineMap& lines, qreal v, DiagramItem* item)
+{
+    LineMap::iterator it = lines.find(v, item);
+    if (it != lines.end())
+        lines.erase(it);
+}
+
+bool SnapIndex::nearest(const LineMap& lines, qreal v, qreal tolerance, DiagramItem* item, 
+    qreal& offset, qreal& line)
+{
+    bool found = false;
+    LineMap::const_iterator it = lines.lowerBound(v - tolerance);
+    for (; it != lines.constEnd() && it.key() < v + tolerance; ++it)
+    {
+        if (it.value() == item)
+            continue;
+        // an edge already on a line is the best match: no offset, but
+        // the guide is shown
+        qreal d = it.key() - v;
+        if (!found || qAbs(d) < qAbs(offset))
+        {
+            offset = d;
+            line = it.key();
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool SnapIndex::nearestGap(const GapMap& gaps, qreal g, qreal tolerance, qreal& gap, Neighbours& pair)
+{
+    bool found = false;
+    GapMap::const_iterator it = gaps.lowerBound(g - tolerance);
+    for (; it != gaps.constEnd() && it.key() < g + tolerance; ++it)
+    {
+        if (!found || qAbs(it.key() - g) < qAbs(gap - g))
+        {
+            gap = it.key();
+            pair = it.value();
+            found = true;
+        }
+    }
+    return found;
+}
+
+// the closest item after rc on the axis that overlaps it across the axis.
+// the edges are walked in order up to the first overlapping item, so this
+// is exact; it is only used for the dragged item, once per axis and move.
+DiagramItem* SnapIndex::nextItem(const QRectF& rc, DiagramItem* item, bool horz) const
+{
+    const LineMap& lows = horz ? m_lefts : m_tops;
+    LineMap::const_iterator it = lows.lowerBound(highEdge(rc, horz));
+    for (; it != lows.constEnd(); ++it)
+    {
+        DiagramItem* t = it.value();
+        if (t == item)
+            continue;
+        if (overlapsAcross(m_rects.value(t), rc, horz))
+            return t;
+    }
+    return NULL;
+}
+
+DiagramItem* SnapIndex::previousItem(const QRectF& rc, DiagramItem* item, bool horz) const
+{
+    const LineMap& highs = horz ? m_rights : m_bottoms;
+    LineMap::const_iterator it = highs.upperBound(lowEdge(rc, horz));
+    while (it != highs.constBegin())
+    {
+        --it;
+        DiagramItem* t = it.value();
+        if (t == item)
+            continue;
+        if (overlapsAcross(m_rects.value(t), rc, horz))
+            return t;
+    }
+    return NULL;
+}
+
+void SnapIndex::rebuildGaps()
+{
+    m_hGaps.clear();
+    m_vGaps.clear();
+    buildGaps(true, m_hGaps);
+    buildGaps(false, m_vGaps);
+    m_gapsDirty = false;
+}
+
+// the gap from every item to its nextItem(), for all items at once: a sweep
+// from the far end of the axis. items are added to a CoverTree over the
+// across axis once their low edge is past the high edge being looked at,
+// so the tree answers with the true nearest overlapping item. empty rects
+// overlap nothing and are left out.
+void SnapIndex::buildGaps(bool horz, GapMap& gaps) const
+{
+    QVector<DiagramItem*> items;
+    QVector<QRectF> rects;
+    QHash<DiagramItem*, QRectF>::const_iterator it = m_rects.constBegin();
+    for (; it != m_rects.constEnd(); ++it)
+    {
+        if (it.value().isEmpty())
+            continue;
+        items.append(it.key());
+        rects.append(it.value());
+    }
+    if (items.isEmpty())
+        return;
+
+    QVector<qreal> across;
+    QVector<qreal> keys;
+    QVector<QPair<qreal, int> > lows;
+    QVector<QPair<qreal, int> > highs;
+    for (int i=0; i<rects.size(); i++)
+    {
+        across.append(lowEdge(rects[i], !horz));
+        across.append(highEdge(rects[i], !horz));
+        keys.append(lowEdge(rects[i], horz));
+        lows.append(qMakePair(lowEdge(rects[i], horz), i));
+        highs.append(qMakePair(highEdge(rects[i], horz), i));
+    }
+    qSort(across);
+    int unique = 0;
+    for (int i=0; i<across.size(); i++)
+    {
+        if (unique == 0 || across[i] != across[unique - 1])
+            across[unique++] = across[i];
+    }
+    across.resize(unique);
+    qSort(lows);
+    qSort(highs);
+
+    CoverTree tree(across.size() - 1, keys);
+    int next = lows.size() - 1;
+    for (int q=highs.size() - 1; q>=0; q--)
+    {
+        qreal high = highs[q].first;
+        for (; next >= 0 && lows[next].first >= high; next--)
+        {
+            const QRectF& rc = rects[lows[next].second];
+            tree.insert(segmentIndex(across, lowEdge(rc, !horz)), segmentIndex(across, highEdge(rc, !horz)),
+                lows[next].second);
+        }
+        int i = highs[q].second;
+        int j = tree.nearest(segmentIndex(across, lowEdge(rects[i], !horz)), segmentIndex(across, highEdge(rects[i], !horz)));
+        if (j >= 0)
+            gaps.insert(keys[j] - high, qMakePair(items[i], items[j]));
+    }
+}
+
+void SnapIndex::snapAxis(DiagramItem* item, const QRectF& rc, bool horz, qreal tolerance, 
+    qreal gridSize, SnapResult& result)
+{
+    const LineMap& lows = horz ? m_lefts : m_tops;
+    const LineMap& highs = horz ? m_rights : m_bottoms;
+    const LineMap& centres = horz ? m_xCentres : m_yCentres;
+
+    // alignment: edges to edges, centre to centre
+    bool aligned = false;
+    qreal alignOffset = 0;
+    qreal alignLine = 0;
+    struct Probe
+    {
+        const LineMap* lines;
+        qreal value;
+    };
+    Probe probes[] = {
+        {&lows, lowEdge(rc, horz)},
+        {&highs, lowEdge(rc, horz)},
+        {&lows, highEdge(rc, horz)},
+        {&highs, highEdge(rc, horz)},
+        {&centres, centreLine(rc, horz)},
+    };
+    for (unsigned i=0; i<sizeof(probes)/sizeof(probes[0]); i++)
+    {
+        qreal offset = 0;
+        qreal line = 0;
+        if (!nearest(*probes[i].lines, probes[i].value, tolerance, item, offset, line))
+            continue;
+        if (!aligned || qAbs(offset) < qAbs(alignOffset))
+        {
+            alignOffset = offset;
+            alignLine = line;
+            aligned = true;
+        }
+    }
+
+    // equal spacing: centred between both neighbours, or the same gap to
+    // one neighbour as an existing pair of neighbours has
+    bool spaced = false;
+    qreal spaceOffset = 0;
+    QVector<QLineF> marks;
+    DiagramItem* prev = previousItem(rc, item, horz);
+    DiagramItem* next = nextItem(rc, item, horz);
+    QRectF prevRect = m_rects.value(prev);
+    QRectF nextRect = m_rects.value(next);
+    qreal gPrev = lowEdge(rc, horz) - highEdge(prevRect, horz);
+    qreal gNext = lowEdge(nextRect, horz) - highEdge(rc, horz);
+    if (prev != NULL && next != NULL)
+    {
+        qreal d = (gNext - gPrev) / 2;
+        if (qAbs(d) < tolerance)
+        {
+            QRectF moved = translatedOnAxis(rc, d, horz);
+            spaceOffset = d;
+            spaced = true;
+            marks.clear();
+            marks.append(gapMark(prevRect, moved, horz));
+            marks.append(gapMark(moved, nextRect, horz));
+        }
+    }
+    GapMap& gaps = horz ? m_hGaps : m_vGaps;
+    qreal gap = 0;
+    Neighbours pair;
+    if (prev != NULL && nearestGap(gaps, gPrev, tolerance, gap, pair))
+    {
+        qreal d = gap - gPrev;
+        if (!spaced || qAbs(d) < qAbs(spaceOffset))
+        {
+            QRectF moved = translatedOnAxis(rc, d, horz);
+            spaceOffset = d;
+            spaced = true;
+            marks.clear();
+            marks.append(gapMark(m_rects.value(pair.first), m_rects.value(pair.second), horz));
+            marks.append(gapMark(prevRect, moved, horz));
+        }
+    }
+    if (next != NULL && nearestGap(gaps, gNext, tolerance, gap, pair))
+    {
+        qreal d = gNext - gap;
+        if (!spaced || qAbs(d) < qAbs(spaceOffset))
+        {
+            QRectF moved = translatedOnAxis(rc, d, horz);
+            spaceOffset = d;
+            spaced = true;
+            marks.clear();
+            marks.append(gapMark(m_rects.value(pair.first), m_rects.value(pair.second), horz));
+            marks.append(gapMark(moved, nextRect, horz));
+        }
+    }
+
+    qreal d = 0;
+    if (aligned && (!spaced || qAbs(alignOffset) <= qAbs(spaceOffset)))
+    {
+        d = alignOffset;
+        (horz ? result.xLines : result.yLines).append(alignLine);
+    }
+    else if (spaced)
+    {
+        d = spaceOffset;
+        result.spacingMarks += marks;
+    }
+    else if (gridSize > 0)
+    {
+        qreal v = lowEdge(rc, horz);
+        d = qRound(v / gridSize) * gridSize - v;
+        if (qAbs(d) >= tolerance || qFuzzyIsNull(d))
+            return;
+        (horz ? result.xLines : result.yLines).append(v + d);
+    }
+    else
+        return;
+
+    if (horz)
+    {
+        result.dx = d;
+        result.snapX = true;
+    }
+    else
+    {
+        result.dy = d;
+        result.snapY = true;
+    }
+}
+
+SnapResult SnapIndex::snap(DiagramItem* item, const QRectF& rc, qreal tolerance, qreal gridSize)
+{
+    if (m_gapsDirty)
+        rebuildGaps();
+    SnapResult result;
+    snapAxis(item, rc, true, tolerance, gridSize, result);
+    snapAxis(item, rc, false, tolerance, gridSize, result);
+    return result;
+}
+
+bool matchSize(const QMultiMap<qreal, DiagramItem*>& sizes, DiagramItem* item, qreal& v, qreal tolerance)
+{
+    bool found = false;
+    qreal best = v;
+    QMultiMap<qreal, DiagramItem*>::const_iterator it = sizes.lowerBound(v - tolerance);
+    for (; it != sizes.constEnd() && it.key() < v + tolerance; ++it)
+    {
+        if (it.value() == item)
+            continue;
+        if (!found || qAbs(it.key() - v) < qAbs(best - v))
+        {
+            best = it.key();
+            found = true;
+        }
+    }
+    v = best;
+    return found;
+}
+
+bool SnapIndex::matchWidth(DiagramItem* item, qreal& w, qreal tolerance) const
+{
+    return matchSize(m_widths, item, w, tolerance);
+}
+
+bool SnapIndex::matchHeight(DiagramItem* item, qreal& h, qreal tolerance) const
+{
+    return matchSize(m_heights, item, h, tolerance);
+}
@@ -0,0 +1,101 @@
+#ifndef SNAPINDEX_H
+#define SNAPINDEX_H
+
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QPair>
+#include <QRectF>
+#include <QLineF>
+#include <QVector>
+
+class DiagramItem;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// what a drag should snap to. each axis snaps on its own; the guides are
+// what the scene draws while the snap is active.
+struct SnapResult
+{
+    SnapResult() : dx(0), dy(0), snapX(false), snapY(false) {}
+    bool isNull() const {return !snapX && !snapY;}
+
+    qreal dx;
+    qreal dy;
+    bool snapX;
+    bool snapY;
+    QVector<qreal> xLines;          // alignment, drawn across the view
+    QVector<qreal> yLines;
+    QVector<QLineF> spacingMarks;   // equal gaps, drawn as segments
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// scene rects of the diagram items, kept as sorted maps of their edges,
+// centre lines and sizes. the scene updates an entry whenever an item
+// moves, resizes, or enters or leaves it, so a query only looks at the
+// lines within the tolerance instead of at every item.
+//
+// on top of that sits an index of the gaps between horizontal and
+// vertical neighbours, for equal-spacing guides. it is rebuilt lazily
+// after changes. the items being dragged are taken out of both for the
+// drag: nothing snaps to an item that moves along with it, and their
+// moves do not invalidate the gaps.
+
+class SnapIndex
+{
+public:
+    SnapIndex() : m_gapsDirty(true) {}
+
+    void insert(DiagramItem* item, const QRectF& rc);
+    void remove(DiagramItem* item);
+    void clear();
+    bool contains(DiagramItem* item) const {return m_rects.contains(item) || m_dragRects.contains(item);}
+    int count() const {return m_rects.count() + m_dragRects.count();}
+
+    // an empty list ends the drag and puts the items back
+    void setDragItems(const QList<DiagramItem*>& items);
+
+    // alignment, equal spacing and, when gridSize > 0 and nothing else
+    // matched on an axis, the grid.
+    SnapResult snap(DiagramItem* item, const QRectF& rc, qreal tolerance, qreal gridSize);
+    // the closest width (height) of another item within tolerance of w (h).
+    bool matchWidth(DiagramItem* item, qreal& w, qreal tolerance) const;
+    bool matchHeight(DiagramItem* item, qreal& h, qreal tolerance) const;
+
+private:
+    typedef QMultiMap<qreal, DiagramItem*> LineMap;
+    typedef QPair<DiagramItem*, DiagramItem*> Neighbours;
+    typedef QMultiMap<qreal, Neighbours> GapMap;
+
+    static void removeLine(LineMap& lines, qreal v, DiagramItem* item);
+    static bool nearest(const LineMap& lines, qreal v, qreal tolerance, DiagramItem* item, 
+        qreal& offset, qreal& line);
+    static bool nearestGap(const GapMap& gaps, qreal g, qreal tolerance, qreal& gap, Neighbours& pair);
+
+    DiagramItem* nextItem(const QRectF& rc, DiagramItem* item, bool horz) const;
+    DiagramItem* previousItem(const QRectF& rc, DiagramItem* item, bool horz) const;
+    void insertLines(DiagramItem* item, const QRectF& rc);
+    void removeLines(DiagramItem* item, const QRectF& rc);
+    void rebuildGaps();
+    void buildGaps(bool horz, GapMap& gaps) const;
+    void snapAxis(DiagramItem* item, const QRectF& rc, bool horz, qreal tolerance, 
+        qreal gridSize, SnapResult& result);
+
+    QHash<DiagramItem*, QRectF> m_rects;
+    LineMap m_lefts;
+    LineMap m_rights;
+    LineMap m_xCentres;
+    LineMap m_tops;
+    LineMap m_bottoms;
+    LineMap m_yCentres;
+    LineMap m_widths;
+    LineMap m_heights;
+
+    QHash<DiagramItem*, QRectF> m_dragRects; // kept apart while dragged
+    bool m_gapsDirty;
+    GapMap m_hGaps;
+    GapMap m_vGaps;
+};
+
+#endif // SNAPINDEX_H
@@ -0,0 +1,436 @@
+#include "stylecache.hxx"
+#include <QApplication>
+#include <QPainter>
+#include <QStyle>
+#include <QStyleOption>
+#include <QStyleOptionGraphicsItem>
+#include <qdrawutil.h>
+#include <qmath.h>
+
+#define MAX_CACHE_RATIO                     8
+#define VECTOR_PART_RATIO                   4 // device pixels per item pixel of the parts in a pdf
+
+///////////////////////////////////////////////////////////////////////////////
+
+StyleCache::StyleCache(int maxEntries) : m_pixmaps(maxEntries), m_parts(maxEntries), m_pictures(maxEntries),
+    m_images(maxEntries)
+{
+}
+
+bool isVectorDevice(QPainter *painter)
+{
+    QPaintEngine* engine = painter->paintEngine();
+    if (engine == NULL)
+        return false;
+    switch (engine->type())
+    {
+    case QPaintEngine::Pdf:
+    case QPaintEngine::SVG:
+    case QPaintEngine::Picture:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isPdfDevice(QPainter *painter)
+{
+    QPaintEngine* engine = painter->paintEngine();
+    return engine != NULL && engine->type() == QPaintEngine::Pdf;
+}
+
+// the three parts, drawn through the style with their top left at the origin
+void renderFrame(QPainter* painter, QWidget* sample, const QStyleOptionFrame& option, const QSize& size)
+{
+    QStyleOptionFrame opt = option;
+    opt.rect = QRect(QPoint(0, 0), size);
+    QApplication::style()->drawPrimitive(QStyle::PE_Frame, &opt, painter, sample);
+}
+
+void renderTrack(QPainter* painter, QWidget* sample, const QStyleOptionSlider& opt)
+{
+    QStyleOptionSlider trackOpt = opt;
+    trackOpt.subControls &= ~QStyle::SC_ScrollBarSlider;
+    QApplication::style()->drawComplexControl(QStyle::CC_ScrollBar, &trackOpt, painter, sample);
+}
+
+void renderHandle(QPainter* painter, QWidget* sample, const QStyleOptionSlider& opt, const QRect& handleRc)
+{
+    painter->translate(-handleRc.topLeft());
+    QStyleOptionSlider handleOpt = opt;
+    handleOpt.subControls = QStyle::SC_ScrollBarSlider;
+    QApplication::style()->drawComplexControl(QStyle::CC_ScrollBar, &handleOpt, painter, sample);
+}
+
+// the device scale rounded up to quarters, or 0 when it is too large to cache
+int StyleCache::ratio(QPainter* painter)
+{
+    qreal scale = QStyleOptionGraphicsItem::levelOfDetailFromTransform(painter->worldTransform()) *
+        painter->device()->devicePixelRatioF();
+    int r = qCeil(scale * 4);
+    if (r > MAX_CACHE_RATIO * 4)
+        return 0;
+    return r;
+}
+
+QPixmap* newPixmap(const QSize& size, int ratio)
+{
+    qreal dpr = ratio / 4.0;
+    QPixmap* pixmap = new QPixmap(size * dpr);
+    pixmap->setDevicePixelRatio(dpr);
+    pixmap->fill(Qt::transparent);
+    return pixmap;
+}
+
+// the border widths of the sample's style sheet, which its border-image is
+// sliced by
+QMargins StyleCache::frameBorders(QWidget* sample, const QStyleOptionFrame& option)
+{
+    QHash<const QWidget*, QMargins>::const_iterator it = m_borders.constFind(sample);
+    if (it != m_borders.constEnd())
+        return it.value();
+    QStyleOptionFrame opt = option;
+    opt.rect = QRect(0, 0, 1000, 1000);
+    QRect contents = sample->style()->subElementRect(QStyle::SE_FrameContents, &opt, sample);
+    QMargins borders(0, 0, 0, 0);
+    if (contents.isValid())
+        borders = QMargins(contents.left(), contents.top(), opt.rect.right() - contents.right(),
+            opt.rect.bottom() - contents.bottom());
+    m_borders.insert(sample, borders);
+    return borders;
+}
+
+// the frame rendered at its borders plus a pixel, and the margins to
+// stretch it by; NULL when the rect is smaller than the borders
+QPixmap* StyleCache::frameSlices(QWidget* sample, const QStyleOptionFrame& option, int ratio, QMargins& margins,
+    StyleCacheKey* keyOut)
+{
+    QRect rc = option.rect;
+    margins = frameBorders(sample, option);
+    if (rc.width() < margins.left() + margins.right() || rc.height() < margins.top() + margins.bottom())
+        return NULL;
+    StyleCacheKey key(CacheFrame, sample, (int)option.state, 0, 0, ratio);
+    if (keyOut != NULL)
+        *keyOut = key;
+
+    QPixmap* slices = m_pixmaps.object(key);
+    if (slices == NULL)
+    {
+        QSize size(margins.left() + margins.right() + 1, margins.top() + margins.bottom() + 1);
+        slices = newPixmap(size, ratio);
+        QPainter p(slices);
+        renderFrame(&p, sample, option, size);
+        p.end();
+        m_pixmaps.insert(key, slices);
+    }
+    return slices;
+}
+
+// opt is the scrollbar at the origin
+QPixmap* StyleCache::scrollTrack(QWidget* sample, const QStyleOptionSlider& opt, int ratio, StyleCacheKey* keyOut)
+{
+    StyleCacheKey key(CacheScrollTrack, sample, (int)opt.state, opt.rect.width(), opt.rect.height(), ratio);
+    if (keyOut != NULL)
+        *keyOut = key;
+    QPixmap* track = m_pixmaps.object(key);
+    if (track == NULL)
+    {
+        track = newPixmap(opt.rect.size(), ratio);
+        QPainter p(track);
+        renderTrack(&p, sample, opt);
+        p.end();
+        m_pixmaps.insert(key, track);
+    }
+    return track;
+}
+
+QPixmap* StyleCache::scrollHandle(QWidget* sample, const QStyleOptionSlider& opt, const QRect& handleRc, int ratio,
+    StyleCacheKey* keyOut)
+{
+    StyleCacheKey key(CacheScrollHandle, sample, (int)opt.state, handleRc.width(), handleRc.height(), ratio);
+    if (keyOut != NULL)
+        *keyOut = key;
+    QPixmap* handle = m_pixmaps.object(key);
+    if (handle == NULL)
+    {
+        handle = newPixmap(handleRc.size(), ratio);
+        QPainter p(handle);
+        renderHandle(&p, sample, opt, handleRc);
+        p.end();
+        m_pixmaps.insert(key, handle);
+    }
+    return handle;
+}
+
+QPicture* StyleCache::framePicture(QWidget* sample, const QStyleOptionFrame& option)
+{
+    StyleCacheKey key(CacheFrame, sample, (int)option.state, option.rect.width(), option.rect.height(), 0);
+    QPicture* picture = m_pictures.object(key);
+    if (picture == NULL)
+    {
+        picture = new QPicture;
+        QPainter p(picture);
+        renderFrame(&p, sample, option, option.rect.size());
+        p.end();
+        m_pictures.insert(key, picture);
+    }
+    return picture;
+}
+
+QPicture* StyleCache::trackPicture(QWidget* sample, const QStyleOptionSlider& opt)
+{
+    StyleCacheKey key(CacheScrollTrack, sample, (int)opt.state, opt.rect.width(), opt.rect.height(), 0);
+    QPicture* picture = m_pictures.object(key);
+    if (picture == NULL)
+    {
+        picture = new QPicture;
+        QPainter p(picture);
+        renderTrack(&p, sample, opt);
+        p.end();
+        m_pictures.insert(key, picture);
+    }
+    return picture;
+}
+
+QPicture* StyleCache::handlePicture(QWidget* sample, const QStyleOptionSlider& opt, const QRect& handleRc)
+{
+    StyleCacheKey key(CacheScrollHandle, sample, (int)opt.state, handleRc.width(), handleRc.height(), 0);
+    QPicture* picture = m_pictures.object(key);
+    if (picture == NULL)
+    {
+        picture = new QPicture;
+        QPainter p(picture);
+        renderHandle(&p, sample, opt, handleRc);
+        p.end();
+        m_pictures.insert(key, picture);
+    }
+    return picture;
+}
+
+// the frame slices cut into their nine parts, left to right and top to
+// bottom; a part with no size is null. NULL when the frame has no slices.
+QVector<QPixmap>* StyleCache::frameParts(QWidget* sample, const QStyleOptionFrame& option, QMargins& margins)
+{
+    int ratio = VECTOR_PART_RATIO;
+    StyleCacheKey key(CacheFrame, sample, 0, 0, 0, 0);
+    QPixmap* slices = frameSlices(sample, option, ratio * 4, margins, &key);
+    if (slices == NULL)
+        return NULL;
+    key.kind = CacheFrameParts;
+    QVector<QPixmap>* parts = m_parts.object(key);
+    if (parts == NULL)
+    {
+        int xs[4] = {0, margins.left(), margins.left() + 1, margins.left() + 1 + margins.right()};
+        int ys[4] = {0, margins.top(), margins.top() + 1, margins.top() + 1 + margins.bottom()};
+        parts = new QVector<QPixmap>;
+        for (int j=0; j<3; j++)
+        {
+            for (int i=0; i<3; i++)
+            {
+                QRect source(xs[i] * ratio, ys[j] * ratio, (xs[i + 1] - xs[i]) * ratio, (ys[j + 1] - ys[j]) * ratio);
+                parts->append(source.isEmpty() ? QPixmap() : slices->copy(source));
+            }
+        }
+        m_parts.insert(key, parts);
+    }
+    return parts;
+}
+
+// stretched like qDrawBorderPixmap, but every part is drawn whole, so the
+// pdf engine sees the same pixmap each time
+bool StyleCache::drawFrameParts(QPainter* painter, QWidget* sample, const QStyleOptionFrame& option)
+{
+    QMargins margins;
+    QVector<QPixmap>* parts = frameParts(sample, option, margins);
+    if (parts == NULL)
+        return false;
+    QRect rc = option.rect;
+    int xs[4] = {rc.x(), rc.x() + margins.left(), rc.x() + rc.width() - margins.right(), rc.x() + rc.width()};
+    int ys[4] = {rc.y(), rc.y() + margins.top(), rc.y() + rc.height() - margins.bottom(), rc.y() + rc.height()};
+    for (int j=0; j<3; j++)
+    {
+        for (int i=0; i<3; i++)
+        {
+            const QPixmap& part = parts->at(j * 3 + i);
+            QRect target(xs[i], ys[j], xs[i + 1] - xs[i], ys[j + 1] - ys[j]);
+            if (!part.isNull() && !target.isEmpty())
+                painter->drawPixmap(target, part);
+        }
+    }
+    return true;
+}
+
+void StyleCache::drawFrame(QPainter* painter, QWidget* sample, QStyleOptionFrame& option)
+{
+    if (isVectorDevice(painter) && !option.rect.isEmpty())
+    {
+        if (!isPdfDevice(painter) || !drawFrameParts(painter, sample, option))
+            painter->drawPicture(option.rect.topLeft(), *framePicture(sample, option));
+        return;
+    }
+    int ratio = this->ratio(painter);
+    if (option.rect.isEmpty() || ratio <= 0)
+    {
+        QApplication::style()->drawPrimitive(QStyle::PE_Frame, &option, painter, sample);
+        return;
+    }
+    QMargins margins;
+    QPixmap* slices = frameSlices(sample, option, ratio, margins);
+    if (slices == NULL)
+    {
+        QApplication::style()->drawPrimitive(QStyle::PE_Frame, &option, painter, sample);
+        return;
+    }
+    qDrawBorderPixmap(painter, option.rect, margins, *slices);
+}
+
+void StyleCache::drawVScrollBar(QPainter* painter, QWidget* sample, QStyleOptionSlider& option)
+{
+    QRect rc = option.rect;
+    int ratio = this->ratio(painter);
+    QStyle* style = QApplication::style();
+    if (rc.isEmpty() || (ratio <= 0 && !isVectorDevice(painter)))
+    {
+        style->drawComplexControl(QStyle::CC_ScrollBar, &option, painter, sample);
+        return;
+    }
+
+    // both parts are rendered and positioned with the bar at the origin
+    QStyleOptionSlider opt = option;
+    opt.rect = QRect(QPoint(0, 0), rc.size());
+    QRect handleRc = style->subControlRect(QStyle::CC_ScrollBar, &opt, QStyle::SC_ScrollBarSlider, sample);
+    if (isPdfDevice(painter))
+    {
+        int partRatio = VECTOR_PART_RATIO * 4;
+        painter->drawPixmap(rc, *scrollTrack(sample, opt, partRatio));
+        if (!handleRc.isEmpty())
+            painter->drawPixmap(handleRc.translated(rc.topLeft()), *scrollHandle(sample, opt, handleRc, partRatio));
+        return;
+    }
+    if (isVectorDevice(painter))
+    {
+        painter->drawPicture(rc.topLeft(), *trackPicture(sample, opt));
+        if (!handleRc.isEmpty())
+            painter->drawPicture(rc.topLeft() + handleRc.topLeft(), *handlePicture(sample, opt, handleRc));
+        return;
+    }
+    painter->drawPixmap(rc.topLeft(), *scrollTrack(sample, opt, ratio));
+    if (!handleRc.isEmpty())
+        painter->drawPixmap(rc.topLeft() + handleRc.topLeft(), *scrollHandle(sample, opt, handleRc, ratio));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int detachedRatio(qreal scale)
+{
+    return qBound(1, qCeil(scale * 4), MAX_CACHE_RATIO * 4);
+}
+
+QImage imageOf(const QPixmap* pixmap)
+{
+    QImage image = pixmap->toImage();
+    image.setDevicePixelRatio(pixmap->devicePixelRatio());
+    return image;
+}
+
+// one image per cached part: every op that hits the same pixmap shares it,
+// so a snapshot holds one copy per distinct part, not one per op
+QImage StyleCache::detachedImage(const StyleCacheKey& key, const QPixmap* pixmap)
+{
+    QImage* image = m_images.object(key);
+    if (image == NULL)
+    {
+        image = new QImage(imageOf(pixmap));
+        m_images.insert(key, image);
+    }
+    return *image;
+}
+
+bool StyleCache::detachFrame(QWidget* sample, const QStyleOptionFrame& option, qreal scale, DetachedStyle& style)
+{
+    if (option.rect.isEmpty())
+        return false;
+    int ratio = detachedRatio(scale);
+    style.handle = QImage();
+    StyleCacheKey key(CacheFrame, sample, 0, 0, 0, 0);
+    QPixmap* slices = frameSlices(sample, option, ratio, style.margins, &key);
+    if (slices != NULL)
+    {
+        style.image = detachedImage(key, slices);
+        return true;
+    }
+    // smaller than its borders: the frame at its exact size, uncached
+    QPixmap exact(option.rect.size() * (ratio / 4.0));
+    exact.setDevicePixelRatio(ratio / 4.0);
+    exact.fill(Qt::transparent);
+    QPainter p(&exact);
+    renderFrame(&p, sample, option, option.rect.size());
+    p.end();
+    style.image = imageOf(&exact);
+    style.margins = QMargins();
+    return true;
+}
+
+bool StyleCache::detachVScrollBar(QWidget* sample, const QStyleOptionSlider& option, qreal scale, DetachedStyle& style)
+{
+    if (option.rect.isEmpty())
+        return false;
+    int ratio = detachedRatio(scale);
+    QStyleOptionSlider opt = option;
+    opt.rect = QRect(QPoint(0, 0), option.rect.size());
+    StyleCacheKey key(CacheScrollTrack, sample, 0, 0, 0, 0);
+    QPixmap* track = scrollTrack(sample, opt, ratio, &key);
+    style.image = detachedImage(key, track);
+    style.margins = QMargins();
+    QRect handleRc = QApplication::style()->subControlRect(QStyle::CC_ScrollBar, &opt,
+        QStyle::SC_ScrollBarSlider, sample);
+    style.handle = QImage();
+    if (!handleRc.isEmpty())
+    {
+        QPixmap* handle = scrollHandle(sample, opt, handleRc, ratio, &key);
+        style.handle = detachedImage(key, handle);
+        style.handlePos = handleRc.topLeft();
+    }
+    return true;
+}
+
+// QImage size in item pixels
+QSizeF logicalSize(const QImage& image)
+{
+    return QSizeF(image.size()) / image.devicePixelRatio();
+}
+
+void StyleCache::drawDetached(QPainter* painter, const QRect& rc, const DetachedStyle& style)
+{
+    if (style.image.isNull())
+        return;
+    if (!style.handle.isNull())
+    {
+        painter->drawImage(QRectF(rc.topLeft(), logicalSize(style.image)), style.image);
+        painter->drawImage(QRectF(rc.topLeft() + style.handlePos, logicalSize(style.handle)), style.handle);
+        return;
+    }
+
+    // nine slices; an axis with no margin has a single span, which is the
+    // image as is when it was rendered at the exact size
+    const QMargins& m = style.margins;
+    qreal dpr = style.image.devicePixelRatio();
+    QSizeF size = logicalSize(style.image);
+    qreal sx[4] = {0, (qreal)m.left(), size.width() - m.right(), size.width()};
+    qreal sy[4] = {0, (qreal)m.top(), size.height() - m.bottom(), size.height()};
+    qreal tx[4] = {(qreal)rc.left(), (qreal)rc.left() + m.left(), (qreal)rc.left() + rc.width() - m.right(),
+        (qreal)rc.left() + rc.width()};
+    qreal ty[4] = {(qreal)rc.top(), (qreal)rc.top() + m.top(), (qreal)rc.top() + rc.height() - m.bottom(),
+        (qreal)rc.top() + rc.height()};
+    for (int row=0; row<3; row++)
+    {
+        for (int col=0; col<3; col++)
+        {
+            QRectF target(QPointF(tx[col], ty[row]), QPointF(tx[col + 1], ty[row + 1]));
+            QRectF source(QPointF(sx[col], sy[row]) * dpr, QPointF(sx[col + 1], sy[row + 1]) * dpr);
+            if (target.isEmpty() || source.isEmpty())
+                continue;
+            painter->drawImage(target, style.image, source);
+        }
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef STYLECACHE_H
+#define STYLECACHE_H
+
+#include <QCache>
+#include <QHash>
+#include <QImage>
+#include <QMargins>
+#include <QPicture>
+#include <QPixmap>
+#include <QRect>
+#include <QVector>
+
+class QPainter;
+class QWidget;
+class QStyleOptionFrame;
+class QStyleOptionSlider;
+
+// pdf, svg and picture targets, which should get painter calls, not pixels
+bool isVectorDevice(QPainter *painter);
+
+///////////////////////////////////////////////////////////////////////////////
+
+enum StyleCacheKind
+{
+    CacheFrame,
+    CacheScrollTrack,
+    CacheScrollHandle,
+    CacheFrameParts,
+};
+
+struct StyleCacheKey
+{
+    StyleCacheKey(StyleCacheKind k, const QWidget* s, int st, int w, int h, int r)
+        : kind(k), sample(s), state(st), width(w), height(h), ratio(r) {}
+    bool operator==(const StyleCacheKey& o) const
+    {
+        return kind == o.kind && sample == o.sample && state == o.state && width == o.width &&
+            height == o.height && ratio == o.ratio;
+    }
+    StyleCacheKind kind;
+    const QWidget* sample;
+    int state;
+    int width;  // 0 for frame slices
+    int height; // 0 for frame slices
+    int ratio;  // device pixels per item pixel, in quarters
+};
+
+inline uint qHash(const StyleCacheKey& key)
+{
+    return qHash((quintptr)key.sample) ^ (uint)key.kind ^ (uint)key.state ^ ((uint)key.width << 8) ^
+        ((uint)key.height << 16) ^ ((uint)key.ratio << 24);
+}
+
+// a style part taken out of the cache as images, so that threads other
+// than the gui thread can draw it with drawDetached.
+struct DetachedStyle
+{
+    QImage image;       // the 9-slice source of a frame, or a scrollbar's track
+    QMargins margins;   // slice margins, 0 for an image drawn at its exact size
+    QImage handle;      // a scrollbar's handle, null for frames
+    QPoint handlePos;   // relative to the track
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// renders style primitives drawn against stylesheet-bearing sample widgets
+// once per (sample, state, scale) into a small 9-slice pixmap and stretches
+// that to the target rect. the slice margins are the sample's own border
+// widths, so its border-image corners and edges keep their size; a rect
+// smaller than those borders, and anything else the cache cannot serve,
+// is drawn through the style.
+//
+// scrollbars are cached as two parts: the track (groove and arrows) by its
+// size, and the handle by its own size. a scrollbar is the track with the
+// handle drawn at the position the style gives for its value, so a new
+// value costs no style rendering.
+//
+// pdf gets the same parts as pixmaps at VECTOR_PART_RATIO, a frame cut into
+// its nine parts. every use of a part draws the same QPixmap whole, so the
+// pdf engine writes each distinct part once and references it after that.
+// svg and picture targets embed every image they are given, so there the
+// parts are recorded as pictures at their exact size and replayed; the
+// style still runs once per part, but each replay is written out in full.
+class StyleCache
+{
+public:
+    explicit StyleCache(int maxEntries = 128);
+
+    void drawFrame(QPainter* painter, QWidget* sample, QStyleOptionFrame& option);
+    void drawVScrollBar(QPainter* painter, QWidget* sample, QStyleOptionSlider& option);
+    void clear() {m_pixmaps.clear(); m_parts.clear(); m_pictures.clear(); m_images.clear(); m_borders.clear();}
+
+    // gui thread only; scale is the device pixels per item pixel of the
+    // target. drawDetached is safe on any thread.
+    bool detachFrame(QWidget* sample, const QStyleOptionFrame& option, qreal scale, DetachedStyle& style);
+    bool detachVScrollBar(QWidget* sample, const QStyleOptionSlider& option, qreal scale, DetachedStyle& style);
+    static void drawDetached(QPainter* painter, const QRect& rc, const DetachedStyle& style);
+
+private:
+    int ratio(QPainter* painter);
+    QMargins frameBorders(QWidget* sample, const QStyleOptionFrame& option);
+    // key, when given, receives the cache key of the returned pixmap
+    QPixmap* frameSlices(QWidget* sample, const QStyleOptionFrame& option, int ratio, QMargins& margins,
+        StyleCacheKey* key = NULL);
+    QPixmap* scrollTrack(QWidget* sample, const QStyleOptionSlider& opt, int ratio, StyleCacheKey* key = NULL);
+    QPixmap* scrollHandle(QWidget* sample, const QStyleOptionSlider& opt, const QRect& handleRc, int ratio,
+        StyleCacheKey* key = NULL);
+    QImage detachedImage(const StyleCacheKey& key, const QPixmap* pixmap);
+    QVector<QPixmap>* frameParts(QWidget* sample, const QStyleOptionFrame& option, QMargins& margins);
+    bool drawFrameParts(QPainter* painter, QWidget* sample, const QStyleOptionFrame& option);
+    QPicture* framePicture(QWidget* sample, const QStyleOptionFrame& option);
+    QPicture* trackPicture(QWidget* sample, const QStyleOptionSlider& opt);
+    QPicture* handlePicture(QWidget* sample, const QStyleOptionSlider& opt, const QRect& handleRc);
+
+    QCache<StyleCacheKey, QPixmap> m_pixmaps;
+    QCache<StyleCacheKey, QVector<QPixmap> > m_parts; // frame slices cut for pdf
+    QCache<StyleCacheKey, QPicture> m_pictures;
+    QCache<StyleCacheKey, QImage> m_images; // detached copies of m_pixmaps
+    QHash<const QWidget*, QMargins> m_borders;
+};
+
+#endif // STYLECACHE_H
@@ -0,0 +1,121 @@
+#include "textmetrics.hxx"
+#include <QMutexLocker>
+#include <QRect>
+
+#define MAX_WIDGET_WIDTH                    2000
+
+///////////////////////////////////////////////////////////////////////////////
+
+TextMetrics* TextMetrics::instance()
+{
+    static TextMetrics s_instance;
+    return &s_instance;
+}
+
+TextMetrics::TextMetrics(int maxEntries) : m_cache(maxEntries), m_boundsCache(maxEntries), m_generation(0), m_hits(0), m_misses(0)
+{
+}
+
+TextMetrics::~TextMetrics()
+{
+}
+
+QFontMetrics TextMetrics::metrics(const QFont& font, const QString& fontKey)
+{
+    ThreadMetrics& local = m_threadMetrics.localData();
+    int generation = m_generation.load();
+    if (local.generation != generation)
+    {
+        local.metrics.clear();
+        local.generation = generation;
+    }
+    QHash<QString, QFontMetrics>::iterator it = local.metrics.find(fontKey);
+    if (it == local.metrics.end())
+        it = local.metrics.insert(fontKey, QFontMetrics(font));
+    return it.value();
+}
+
+// the measuring runs unlocked; two threads missing the same key both
+// measure it, and the second insert replaces the first
+int TextMetrics::width(const QFont& font, const QString& text)
+{
+    QString fontKey = font.key();
+    TextMeasureKey key(fontKey, text, -1);
+    QMutexLocker locker(&m_mutex);
+    int* cached = m_cache.object(key);
+    if (cached != NULL)
+    {
+        m_hits.ref();
+        return *cached;
+    }
+    locker.unlock();
+    m_misses.ref();
+    int w = metrics(font, fontKey).width(text);
+    locker.relock();
+    m_cache.insert(key, new int(w));
+    return w;
+}
+
+int TextMetrics::height(const QFont& font, const QString& text, int wrapWidth)
+{
+    if (wrapWidth < 0)
+        wrapWidth = 0;
+    QString fontKey = font.key();
+    TextMeasureKey key(fontKey, text, wrapWidth);
+    QMutexLocker locker(&m_mutex);
+    int* cached = m_cache.object(key);
+    if (cached != NULL)
+    {
+        m_hits.ref();
+        return *cached;
+    }
+    locker.unlock();
+    m_misses.ref();
+    QRect rc = metrics(font, fontKey).boundingRect(0,0, wrapWidth, MAX_WIDGET_WIDTH, 
+        Qt::AlignLeft | Qt::AlignTop | Qt::TextWrapAnywhere | Qt::TextWordWrap, text);
+    locker.relock();
+    m_cache.insert(key, new int(rc.height()));
+    return rc.height();
+}
+
+int TextMetrics::lineHeight(const QFont& font)
+{
+    return metrics(font, font.key()).height();
+}
+
+// the layout only depends on the size of rc, so bounds are cached relative
+// to its top left and shared by every rect of that size
+QRect TextMetrics::boundingRect(const QFont& font, const QRect& rc, int flags, const QString& text)
+{
+    QString fontKey = font.key();
+    TextBoundsKey key(fontKey, text, flags, rc.size());
+    QMutexLocker locker(&m_mutex);
+    QRect* cached = m_boundsCache.object(key);
+    if (cached != NULL)
+    {
+        m_hits.ref();
+        return cached->translated(rc.topLeft());
+    }
+    locker.unlock();
+    m_misses.ref();
+    QRect bounds = metrics(font, fontKey).boundingRect(QRect(QPoint(0, 0), rc.size()), flags, text);
+    locker.relock();
+    m_boundsCache.insert(key, new QRect(bounds));
+    return bounds.translated(rc.topLeft());
+}
+
+void TextMetrics::resetCounters()
+{
+    m_hits.store(0);
+    m_misses.store(0);
+}
+
+// the metrics of other threads can't be touched from here; they notice the
+// new generation on their next measurement
+void TextMetrics::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_cache.clear();
+    m_boundsCache.clear();
+    m_generation.ref();
+}
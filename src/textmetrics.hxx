@@ -0,0 +1,96 @@
+#ifndef TEXTMETRICS_H
+#define TEXTMETRICS_H
+
+#include <QAtomicInt>
+#include <QCache>
+#include <QFont>
+#include <QFontMetrics>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QThreadStorage>
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct TextMeasureKey
+{
+    TextMeasureKey(const QString& f, const QString& t, int w) : font(f), text(t), wrapWidth(w) {}
+    bool operator==(const TextMeasureKey& o) const
+    {
+        return wrapWidth == o.wrapWidth && font == o.font && text == o.text;
+    }
+    QString font;
+    QString text;
+    int wrapWidth; // -1 for single line width
+};
+
+inline uint qHash(const TextMeasureKey& key)
+{
+    return qHash(key.font) ^ qHash(key.text) ^ (uint)key.wrapWidth;
+}
+
+struct TextBoundsKey
+{
+    TextBoundsKey(const QString& f, const QString& t, int fl, const QSize& s) : font(f), text(t), flags(fl), size(s) {}
+    bool operator==(const TextBoundsKey& o) const
+    {
+        return flags == o.flags && size == o.size && font == o.font && text == o.text;
+    }
+    QString font;
+    QString text;
+    int flags;
+    QSize size;
+};
+
+inline uint qHash(const TextBoundsKey& key)
+{
+    return qHash(key.font) ^ qHash(key.text) ^ (uint)key.flags ^ ((uint)key.size.width() << 16) ^ (uint)key.size.height();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// shared text measurement service. memoizes (font, text, wrap width)
+// results and text bounds in bounded LRUs. all methods are safe to call
+// from any thread: each thread measures with its own QFontMetrics, and the
+// lock only covers the cache lookups and inserts, so the load workers
+// measure in parallel.
+class TextMetrics
+{
+public:
+    static TextMetrics* instance();
+
+    explicit TextMetrics(int maxEntries = 20000);
+    ~TextMetrics();
+
+    int width(const QFont& font, const QString& text);
+    int height(const QFont& font, const QString& text, int wrapWidth);
+    int lineHeight(const QFont& font);
+    // where text drawn into rc with flags lands, which may be outside rc
+    QRect boundingRect(const QFont& font, const QRect& rc, int flags, const QString& text);
+
+    int hits() const        {return m_hits.load();}
+    int misses() const      {return m_misses.load();}
+    void resetCounters();
+    void clear();
+
+private:
+    // the metrics of one thread; dropped when clear() bumps the generation
+    struct ThreadMetrics
+    {
+        ThreadMetrics() : generation(-1) {}
+        int generation;
+        QHash<QString, QFontMetrics> metrics;
+    };
+
+    QFontMetrics metrics(const QFont& font, const QString& fontKey);
+
+    QMutex m_mutex; // guards the caches
+    QCache<TextMeasureKey, int> m_cache;
+    QCache<TextBoundsKey, QRect> m_boundsCache;
+    QThreadStorage<ThreadMetrics> m_threadMetrics;
+    QAtomicInt m_generation;
+    QAtomicInt m_hits;
+    QAtomicInt m_misses;
+};
+
+#endif // TEXTMETRICS_H
@@ -0,0 +1,127 @@
+#include "vectorexport.hxx"
+#include "document.hxx"
+#include "imageexport.hxx"
+#include "itemdata.hxx"
+#include <QDir>
+#include <QFileInfo>
+#include <QGuiApplication>
+#include <QPainter>
+#include <QPdfWriter>
+#include <QScreen>
+#include <QSvgGenerator>
+
+#define DEFAULT_EXPORT_DPI                  96
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool VectorExporter::isVectorFormat(const QString& format)
+{
+    return format.compare("pdf", Qt::CaseInsensitive) == 0 || format.compare("svg", Qt::CaseInsensitive) == 0;
+}
+
+VectorExporter::VectorExporter(const QString& fileName, const QString& format)
+    : m_fileName(fileName), m_writer(NULL), m_painter(NULL), m_pages(0)
+{
+    m_pdf = (format.compare("pdf", Qt::CaseInsensitive) == 0);
+    // the layout is measured in screen pixels, so a scene pixel is a
+    // screen pixel on the page too
+    QScreen* screen = QGuiApplication::primaryScreen();
+    m_resolution = screen != NULL ? qRound(screen->logicalDotsPerInch()) : DEFAULT_EXPORT_DPI;
+    if (m_resolution <= 0)
+        m_resolution = DEFAULT_EXPORT_DPI;
+}
+
+VectorExporter::~VectorExporter()
+{
+    end();
+}
+
+QString VectorExporter::pageFileName(int page) const
+{
+    if (page == 0)
+        return m_fileName;
+    QFileInfo info(m_fileName);
+    return info.dir().filePath(QString("%1-%2.%3").arg(info.completeBaseName()).arg(page + 1).arg(info.suffix()));
+}
+
+bool VectorExporter::addPage(DiagramScene* scene)
+{
+    QRectF bounds;
+    foreach (DiagramItem* item, scene->sortedDiagramItems())
+    {
+        if (item->isVisible())
+            bounds |= exportItemBounds(item);
+    }
+    bounds = QRectF(bounds.toAlignedRect());
+    if (bounds.isEmpty())
+        bounds = QRectF(0, 0, 1, 1);
+
+    if (!m_pdf)
+    {
+        QSvgGenerator svg;
+        svg.setFileName(pageFileName(m_pages));
+        svg.setResolution(m_resolution);
+        svg.setSize(bounds.size().toSize());
+        svg.setViewBox(QRectF(QPointF(0, 0), bounds.size()));
+        QPainter painter;
+        if (!painter.begin(&svg))
+            return false;
+        paintItems(&painter, scene, bounds);
+        m_pages++;
+        return painter.end();
+    }
+
+    QPageSize pageSize(bounds.size() * 72.0 / m_resolution, QPageSize::Point, QString(), QPageSize::ExactMatch);
+    if (m_writer == NULL)
+    {
+        m_writer = new QPdfWriter(m_fileName);
+        m_writer->setResolution(m_resolution);
+        m_writer->setPageMargins(QMarginsF(0, 0, 0, 0));
+        m_writer->setPageSize(pageSize);
+        m_painter = new QPainter;
+        if (!m_painter->begin(m_writer))
+            return false;
+    }
+    else
+    {
+        // the finished page is written out here
+        m_writer->setPageSize(pageSize);
+        if (!m_writer->newPage())
+            return false;
+    }
+    paintItems(m_painter, scene, bounds);
+    m_pages++;
+    return true;
+}
+
+bool VectorExporter::end()
+{
+    bool ok = true;
+    if (m_painter != NULL)
+        ok = m_painter->end();
+    delete m_painter;
+    delete m_writer;
+    m_painter = NULL;
+    m_writer = NULL;
+    return ok;
+}
+
+void VectorExporter::paintItems(QPainter* painter, DiagramScene* scene, const QRectF& bounds)
+{
+    painter->save();
+    painter->translate(-bounds.topLeft());
+    foreach (DiagramItem* item, scene->sortedDiagramItems())
+    {
+        if (!item->isVisible())
+            continue;
+        ItemDataBase* data = item->itemData();
+        const DisplayList& list = data->displayList();
+        ThemeInterface* theme = data->context()->theme();
+        painter->save();
+        painter->translate(item->scenePos());
+        for (int i=0; i<list.length(); i++)
+            theme->paint(list, list.at(i), painter, NULL, false);
+        painter->restore();
+    }
+    painter->restore();
+}
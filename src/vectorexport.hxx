@@ -0,0 +1,43 @@
+#ifndef VECTOREXPORT_H
+#define VECTOREXPORT_H
+
+#include <QString>
+
+class DiagramScene;
+class QPainter;
+class QPdfWriter;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// writes scenes as vector pages, cropped to their items. pdf puts every
+// page into one file; svg has no pages, so page n > 1 of name.svg goes to
+// name-n.svg. the items are drawn by walking their display lists, and the
+// style parts (frames, lines, scrollbars) come from the style cache: in a
+// pdf each distinct part is one image, written once and referenced by
+// every use; in svg they are pictures replayed in full at every use. a page is finished before the next
+// one is added, so the pages already written are not kept in memory.
+class VectorExporter
+{
+public:
+    static bool isVectorFormat(const QString& format);
+
+    VectorExporter(const QString& fileName, const QString& format);
+    ~VectorExporter();
+
+    bool addPage(DiagramScene* scene);
+    bool end();
+    int pageCount() const {return m_pages;}
+
+private:
+    void paintItems(QPainter* painter, DiagramScene* scene, const QRectF& bounds);
+    QString pageFileName(int page) const;
+
+    QString m_fileName;
+    bool m_pdf;
+    int m_resolution;
+    QPdfWriter* m_writer;
+    QPainter* m_painter;
+    int m_pages;
+};
+
+#endif // VECTOREXPORT_H